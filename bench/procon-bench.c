@@ -0,0 +1,608 @@
+// Multi-controller stress benchmark for hid-procon
+//
+// Spawns N virtual Pro Controllers through uhid, brings each of them up the
+// way a real controller would (acknowledging the driver's subcommands and
+// holding HOME to enable the gyroscope), then streams input reports at a fixed
+// rate and measures the CPU cost, evdev latency and dropped events.
+//
+// Every report carries a sequence number in the left stick's X axis, so each
+// ABS_X event read back from evdev can be matched to the report that caused it.
+//
+// Requires root, the hid-procon module and its udev rule to be loaded.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+
+#define VENDOR_ID_NINTENDO			0x057e
+#define DEVICE_ID_NINTENDO_PROCON	0x2009
+
+#define PROCON_REPORT_REPLY			0x21
+#define PROCON_REPORT_INPUT_FULL	0x30
+#define PROCON_REPORT_INPUT_SIMPLE	0x3F
+#define PROCON_CMD_AND_RUMBLE		0x01
+#define PROCON_CMD_MODE				0x03
+#define PROCON_CMD_GYRO				0x40
+#define PROCON_ARG_INPUT_FULL		0x30
+
+// reports remembered for matching, must cover the worst case latency
+#define SEQ_WINDOW					0x1000
+
+enum fd_kind { FD_UHID, FD_EVDEV, FD_TIMER };
+
+struct controller
+{
+	int index;
+	int uhid;
+	int evdev;
+	int timer;
+
+	bool open;
+	bool connected;
+	bool full;
+	bool gyro;
+	uint8_t timer_byte;
+
+	uint32_t seq;
+	uint32_t seq_start;
+	uint32_t seq_end;
+	uint64_t sent[SEQ_WINDOW];
+
+	uint32_t *delivery;
+	uint32_t *kernel;
+	size_t received;
+	size_t capacity;
+	unsigned long syn_dropped;
+};
+
+// vendor defined reports sized like the real controller's bluetooth ones
+static const uint8_t procon_rdesc[] =
+{
+	0x06, 0x01, 0xFF,		// Usage Page (Vendor Defined 0xFF01)
+	0x09, 0x21,				// Usage (0x21)
+	0xA1, 0x01,				// Collection (Application)
+	0x15, 0x00,				//   Logical Minimum (0)
+	0x26, 0xFF, 0x00,		//   Logical Maximum (255)
+	0x75, 0x08,				//   Report Size (8)
+	0x85, 0x21,				//   Report ID (0x21)
+	0x09, 0x21,				//   Usage (0x21)
+	0x95, 0x30,				//   Report Count (48)
+	0x81, 0x02,				//   Input (Data,Var,Abs)
+	0x85, 0x30,				//   Report ID (0x30)
+	0x09, 0x30,				//   Usage (0x30)
+	0x95, 0x30,				//   Report Count (48)
+	0x81, 0x02,				//   Input (Data,Var,Abs)
+	0x85, 0x3F,				//   Report ID (0x3F)
+	0x09, 0x3F,				//   Usage (0x3F)
+	0x95, 0x0B,				//   Report Count (11)
+	0x81, 0x02,				//   Input (Data,Var,Abs)
+	0x85, 0x01,				//   Report ID (0x01)
+	0x09, 0x01,				//   Usage (0x01)
+	0x95, 0x30,				//   Report Count (48)
+	0x91, 0x02,				//   Output (Data,Var,Abs)
+	0x85, 0x10,				//   Report ID (0x10)
+	0x09, 0x10,				//   Usage (0x10)
+	0x95, 0x30,				//   Report Count (48)
+	0x91, 0x02,				//   Output (Data,Var,Abs)
+	0xC0,					// End Collection
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+	ssize_t ret = write(fd, ev, sizeof(*ev));
+	if(ret < 0)
+		return -errno;
+	return ret == sizeof(*ev)? 0 : -EFAULT;
+}
+
+static int controller_create(struct controller *ctrl)
+{
+	struct uhid_event ev;
+
+	ctrl->uhid = open("/dev/uhid", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+	if(ctrl->uhid < 0)
+		return -errno;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *) ev.u.create2.name, sizeof(ev.u.create2.name), "Pro Controller");
+	snprintf((char *) ev.u.create2.uniq, sizeof(ev.u.create2.uniq), "procon-bench-%d", ctrl->index);
+	memcpy(ev.u.create2.rd_data, procon_rdesc, sizeof(procon_rdesc));
+	ev.u.create2.rd_size = sizeof(procon_rdesc);
+	ev.u.create2.bus = BUS_BLUETOOTH;
+	ev.u.create2.vendor = VENDOR_ID_NINTENDO;
+	ev.u.create2.product = DEVICE_ID_NINTENDO_PROCON;
+	return uhid_write(ctrl->uhid, &ev);
+}
+
+static int controller_input(struct controller *ctrl, const uint8_t *data, size_t size)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	memcpy(ev.u.input2.data, data, size);
+	ev.u.input2.size = size;
+	return uhid_write(ctrl->uhid, &ev);
+}
+
+// fill the button and stick bytes shared by full and reply reports
+static void controller_fill_full(struct controller *ctrl, uint8_t *data, bool home)
+{
+	unsigned x = ctrl->seq % SEQ_WINDOW;
+	unsigned y = 0x800;
+
+	data[1] = ctrl->timer_byte;
+	data[2] = 0x8E;
+	data[4] = home? 0x10 : 0x00;
+	data[6] = x & 0xFF;
+	data[7] = (x >> 8) | ((y & 0x0F) << 4);
+	data[8] = y >> 4;
+	data[9] = 0x00;
+	data[10] = 0x08;
+	data[11] = 0x80;
+}
+
+static int controller_reply(struct controller *ctrl, uint8_t subcmd)
+{
+	uint8_t data[49] = {PROCON_REPORT_REPLY};
+
+	controller_fill_full(ctrl, data, false);
+	data[13] = 0x80;
+	data[14] = subcmd;
+	return controller_input(ctrl, data, sizeof(data));
+}
+
+static int controller_report(struct controller *ctrl, bool measuring)
+{
+	uint8_t data[49] = {0};
+	// HOME is held until the driver has turned the gyroscope on
+	bool home = !ctrl->gyro;
+	int i;
+
+	ctrl->seq++;
+	ctrl->timer_byte += 2;
+	ctrl->sent[ctrl->seq % SEQ_WINDOW] = now_ns();
+	// only reports sent while measuring are counted
+	if(measuring)
+		ctrl->seq_end = ctrl->seq + 1;
+	else
+		ctrl->seq_start = ctrl->seq_end = ctrl->seq + 1;
+
+	if(ctrl->full)
+	{
+		data[0] = PROCON_REPORT_INPUT_FULL;
+		controller_fill_full(ctrl, data, home);
+		// three IMU samples of accelerometer and gyroscope words, zero until
+		// the driver turns the IMU on
+		for(i = 0;ctrl->gyro && i < 18;i++)
+		{
+			int16_t v = (int16_t) ((ctrl->seq * 37 + i * 101) % 401) - 200;
+			data[13 + i * 2] = v & 0xFF;
+			data[14 + i * 2] = (v >> 8) & 0xFF;
+		}
+		return controller_input(ctrl, data, 49);
+	}
+
+	data[0] = PROCON_REPORT_INPUT_SIMPLE;
+	data[2] = home? 0x10 : 0x00;
+	data[3] = 0x08;
+	data[4] = (0x8000 + ctrl->seq % SEQ_WINDOW) & 0xFF;
+	data[5] = (0x8000 + ctrl->seq % SEQ_WINDOW) >> 8;
+	for(i = 6;i < 12;i += 2)
+		data[i + 1] = 0x80;
+	return controller_input(ctrl, data, 12);
+}
+
+// act like the controller: acknowledge subcommands and follow mode switches
+static int controller_uhid_event(struct controller *ctrl)
+{
+	struct uhid_event ev;
+	ssize_t ret;
+	uint8_t *data;
+
+	ret = read(ctrl->uhid, &ev, sizeof(ev));
+	if(ret < 0)
+		return errno == EAGAIN? 0 : -errno;
+
+	switch(ev.type)
+	{
+	case UHID_OPEN:
+		ctrl->open = true;
+		break;
+	case UHID_CLOSE:
+		ctrl->open = false;
+		break;
+	case UHID_OUTPUT:
+		data = ev.u.output.data;
+		if(ev.u.output.size < 12 || data[0] != PROCON_CMD_AND_RUMBLE)
+			break;
+		if(data[10] == PROCON_CMD_MODE)
+		{
+			ctrl->full = data[11] == PROCON_ARG_INPUT_FULL;
+			ctrl->connected = true;
+		}
+		else if(data[10] == PROCON_CMD_GYRO)
+			ctrl->gyro = data[11];
+		return controller_reply(ctrl, data[10]);
+	}
+	return 0;
+}
+
+// find the evdev node whose HID parent carries our uniq
+static int controller_find_evdev(struct controller *ctrl)
+{
+	char uniq[80];
+	char path[512];
+	char line[256];
+	struct dirent *entry;
+	DIR *dir;
+	FILE *file;
+	int fd = -1;
+
+	snprintf(uniq, sizeof(uniq), "HID_UNIQ=procon-bench-%d\n", ctrl->index);
+	dir = opendir("/sys/class/input");
+	if(!dir)
+		return -errno;
+
+	while(fd < 0 && (entry = readdir(dir)))
+	{
+		if(strncmp(entry->d_name, "event", 5))
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/input/%s/device/device/uevent", entry->d_name);
+		file = fopen(path, "r");
+		if(!file)
+			continue;
+		while(fgets(line, sizeof(line), file))
+			if(!strcmp(line, uniq))
+			{
+				snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+				fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+				break;
+			}
+		fclose(file);
+	}
+	closedir(dir);
+
+	if(fd >= 0)
+	{
+		int clock = CLOCK_MONOTONIC;
+		ioctl(fd, EVIOCSCLOCKID, &clock);
+		ctrl->evdev = fd;
+	}
+	return fd < 0? -ENOENT : 0;
+}
+
+static void controller_evdev_event(struct controller *ctrl)
+{
+	struct input_event ev[64];
+	uint64_t now;
+	ssize_t ret;
+	size_t i;
+
+	while((ret = read(ctrl->evdev, ev, sizeof(ev))) > 0)
+	{
+		now = now_ns();
+		for(i = 0;i < ret / sizeof(ev[0]);i++)
+		{
+			uint64_t stamp = ev[i].input_event_sec * 1000000000ull + ev[i].input_event_usec * 1000ull;
+			unsigned raw;
+			uint32_t seq;
+
+			if(ev[i].type == EV_SYN && ev[i].code == SYN_DROPPED)
+				ctrl->syn_dropped++;
+			if(ev[i].type != EV_ABS || ev[i].code != ABS_X)
+				continue;
+
+			// undo the driver's centering to get the sequence number back
+			raw = (uint16_t) (ev[i].value + 0x7FFF);
+			if(ctrl->full)
+				raw >>= 4;
+			seq = ctrl->seq - ((ctrl->seq - raw) % SEQ_WINDOW);
+			if(seq < ctrl->seq_start || seq >= ctrl->seq_end || ctrl->received == ctrl->capacity)
+				continue;
+
+			ctrl->delivery[ctrl->received] = now - ctrl->sent[seq % SEQ_WINDOW];
+			ctrl->kernel[ctrl->received] = stamp > ctrl->sent[seq % SEQ_WINDOW]? stamp - ctrl->sent[seq % SEQ_WINDOW] : 0;
+			ctrl->received++;
+		}
+	}
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return x < y? -1 : x > y;
+}
+
+static double percentile(const uint32_t *sorted, size_t count, unsigned pct)
+{
+	if(!count)
+		return 0;
+	return sorted[(count - 1) * pct / 100] / 1000.0;
+}
+
+struct cpu_times
+{
+	unsigned long long busy;
+	unsigned long long total;
+	unsigned long long system;
+	unsigned long long irq;
+	unsigned long long softirq;
+};
+
+static int read_cpu_times(struct cpu_times *times)
+{
+	unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+	FILE *file = fopen("/proc/stat", "r");
+	int ret;
+
+	if(!file)
+		return -errno;
+	ret = fscanf(file, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal);
+	fclose(file);
+	if(ret != 8)
+		return -EINVAL;
+
+	times->busy = user + nice + system + irq + softirq + steal;
+	times->total = times->busy + idle + iowait;
+	times->system = system;
+	times->irq = irq;
+	times->softirq = softirq;
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-n controllers] [-r rate] [-d seconds] [-s]\n"
+		"  -n  number of virtual controllers (default 8)\n"
+		"  -r  reports per second per controller (default 120)\n"
+		"  -d  measurement duration in seconds (default 10)\n"
+		"  -s  stay in simple mode instead of enabling the gyroscope\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct controller *ctrls;
+	struct epoll_event events[256];
+	struct cpu_times cpu_start, cpu_end;
+	struct rusage usage_start, usage_end;
+	uint64_t start, deadline, period_ns;
+	unsigned count = 8,
+			 rate = 120,
+			 duration = 10;
+	bool want_gyro = true,
+		 measuring = false,
+		 draining = false;
+	uint32_t *all_delivery, *all_kernel;
+	size_t all_received = 0;
+	unsigned long all_sent = 0,
+				  all_dropped = 0;
+	int epoll;
+	int opt;
+	unsigned i;
+
+	while((opt = getopt(argc, argv, "n:r:d:sh")) != -1)
+	{
+		switch(opt)
+		{
+		case 'n': count = strtoul(optarg, NULL, 0); break;
+		case 'r': rate = strtoul(optarg, NULL, 0); break;
+		case 'd': duration = strtoul(optarg, NULL, 0); break;
+		case 's': want_gyro = false; break;
+		default: usage(argv[0]); return 1;
+		}
+	}
+	if(!count || !rate || !duration)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	period_ns = 1000000000ull / rate;
+	ctrls = calloc(count, sizeof(*ctrls));
+	epoll = epoll_create1(EPOLL_CLOEXEC);
+	if(!ctrls || epoll < 0)
+	{
+		perror("setup");
+		return 1;
+	}
+
+	for(i = 0;i < count;i++)
+	{
+		struct controller *ctrl = &ctrls[i];
+		struct epoll_event ev = {.events = EPOLLIN};
+		struct itimerspec spec = {0};
+		int ret;
+
+		ctrl->index = i;
+		ctrl->evdev = -1;
+		ctrl->gyro = !want_gyro;
+		ctrl->capacity = (size_t) rate * duration + rate;
+		ctrl->delivery = calloc(ctrl->capacity, sizeof(uint32_t));
+		ctrl->kernel = calloc(ctrl->capacity, sizeof(uint32_t));
+
+		ret = controller_create(ctrl);
+		if(ret)
+		{
+			fprintf(stderr, "Could not create controller %u: %s\n", i, strerror(-ret));
+			return 1;
+		}
+
+		// stagger the controllers across one report period
+		ctrl->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		spec.it_interval.tv_nsec = period_ns;
+		spec.it_value.tv_nsec = 1 + period_ns * i / count;
+		timerfd_settime(ctrl->timer, 0, &spec, NULL);
+
+		ev.data.u64 = (uint64_t) i << 2 | FD_UHID;
+		epoll_ctl(epoll, EPOLL_CTL_ADD, ctrl->uhid, &ev);
+		ev.data.u64 = (uint64_t) i << 2 | FD_TIMER;
+		epoll_ctl(epoll, EPOLL_CTL_ADD, ctrl->timer, &ev);
+	}
+
+	printf("Bringing up %u controllers%s...\n", count, want_gyro? " with gyroscope" : "");
+	start = now_ns();
+	deadline = start + 20000000000ull;
+
+	while(true)
+	{
+		uint64_t now = now_ns();
+		int n;
+		int j;
+
+		if(!measuring && !draining)
+		{
+			unsigned ready = 0;
+
+			for(i = 0;i < count;i++)
+			{
+				struct controller *ctrl = &ctrls[i];
+				if(ctrl->open && ctrl->evdev < 0 && !controller_find_evdev(ctrl))
+				{
+					struct epoll_event ev = {.events = EPOLLIN};
+					ev.data.u64 = (uint64_t) i << 2 | FD_EVDEV;
+					epoll_ctl(epoll, EPOLL_CTL_ADD, ctrl->evdev, &ev);
+				}
+				ready += ctrl->connected && ctrl->gyro && ctrl->evdev >= 0;
+			}
+
+			if(ready == count)
+			{
+				printf("Ready after %.1fs, measuring for %us\n", (now - start) / 1e9, duration);
+				read_cpu_times(&cpu_start);
+				getrusage(RUSAGE_SELF, &usage_start);
+				measuring = true;
+				deadline = now + duration * 1000000000ull;
+			}
+			else if(now > deadline)
+			{
+				fprintf(stderr, "Only %u of %u controllers came up, is hid-procon loaded?\n", ready, count);
+				return 1;
+			}
+		}
+		else if(measuring && now > deadline)
+		{
+			read_cpu_times(&cpu_end);
+			getrusage(RUSAGE_SELF, &usage_end);
+			measuring = false;
+			draining = true;
+			deadline = now + 500000000ull;
+		}
+		else if(draining && now > deadline)
+			break;
+
+		n = epoll_wait(epoll, events, 256, 100);
+		for(j = 0;j < n;j++)
+		{
+			struct controller *ctrl = &ctrls[events[j].data.u64 >> 2];
+			uint64_t expirations;
+
+			switch(events[j].data.u64 & 3)
+			{
+			case FD_UHID:
+				controller_uhid_event(ctrl);
+				break;
+			case FD_EVDEV:
+				controller_evdev_event(ctrl);
+				break;
+			case FD_TIMER:
+				if(read(ctrl->timer, &expirations, sizeof(expirations)) > 0 && !draining)
+					controller_report(ctrl, measuring);
+				break;
+			}
+		}
+	}
+
+	all_delivery = calloc((size_t) count * ctrls[0].capacity, sizeof(uint32_t));
+	all_kernel = calloc((size_t) count * ctrls[0].capacity, sizeof(uint32_t));
+
+	printf("\n%4s %8s %8s %8s %9s %9s %9s %9s %9s %9s\n", "ctrl", "sent", "recv", "dropped",
+		   "p50(us)", "p90(us)", "p99(us)", "max(us)", "kp50(us)", "kp99(us)");
+	for(i = 0;i < count;i++)
+	{
+		struct controller *ctrl = &ctrls[i];
+		unsigned long sent = ctrl->seq_end - ctrl->seq_start;
+		unsigned long dropped = sent > ctrl->received? sent - ctrl->received : 0;
+
+		memcpy(all_delivery + all_received, ctrl->delivery, ctrl->received * sizeof(uint32_t));
+		memcpy(all_kernel + all_received, ctrl->kernel, ctrl->received * sizeof(uint32_t));
+		all_received += ctrl->received;
+		all_sent += sent;
+		all_dropped += dropped;
+
+		qsort(ctrl->delivery, ctrl->received, sizeof(uint32_t), compare_u32);
+		qsort(ctrl->kernel, ctrl->received, sizeof(uint32_t), compare_u32);
+		printf("%4u %8lu %8zu %8lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f%s\n", i, sent, ctrl->received, dropped,
+			   percentile(ctrl->delivery, ctrl->received, 50),
+			   percentile(ctrl->delivery, ctrl->received, 90),
+			   percentile(ctrl->delivery, ctrl->received, 99),
+			   percentile(ctrl->delivery, ctrl->received, 100),
+			   percentile(ctrl->kernel, ctrl->received, 50),
+			   percentile(ctrl->kernel, ctrl->received, 99),
+			   ctrl->syn_dropped? " (SYN_DROPPED)" : "");
+	}
+
+	qsort(all_delivery, all_received, sizeof(uint32_t), compare_u32);
+	qsort(all_kernel, all_received, sizeof(uint32_t), compare_u32);
+	printf("\nAll %u controllers: %lu reports, %lu dropped (%.3f%%)\n", count, all_sent, all_dropped,
+		   all_sent? 100.0 * all_dropped / all_sent : 0.0);
+	printf("  evdev delivery p50 %.1fus p90 %.1fus p99 %.1fus max %.1fus\n",
+		   percentile(all_delivery, all_received, 50), percentile(all_delivery, all_received, 90),
+		   percentile(all_delivery, all_received, 99), percentile(all_delivery, all_received, 100));
+	printf("  kernel timestamp p50 %.1fus p99 %.1fus\n",
+		   percentile(all_kernel, all_received, 50), percentile(all_kernel, all_received, 99));
+
+	{
+		double total = cpu_end.total - cpu_start.total;
+		double self = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec +
+					   usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+					  (usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec +
+					   usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec) / 1e6;
+		long ticks = sysconf(_SC_CLK_TCK);
+
+		if(total > 0)
+			printf("  cpu busy %.2f%% (system %.2f%%, irq %.2f%%, softirq %.2f%%) of all cpus, benchmark itself %.2f%%\n",
+				   100.0 * (cpu_end.busy - cpu_start.busy) / total,
+				   100.0 * (cpu_end.system - cpu_start.system) / total,
+				   100.0 * (cpu_end.irq - cpu_start.irq) / total,
+				   100.0 * (cpu_end.softirq - cpu_start.softirq) / total,
+				   100.0 * self * ticks / total);
+	}
+
+	// closing /dev/uhid destroys the virtual controllers
+	for(i = 0;i < count;i++)
+	{
+		if(ctrls[i].evdev >= 0)
+			close(ctrls[i].evdev);
+		close(ctrls[i].timer);
+		close(ctrls[i].uhid);
+	}
+	return 0;
+}
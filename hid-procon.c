@@ -5,6 +5,20 @@
 #include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/delay.h>
+#include <linux/completion.h>
+#include <linux/fixp-arith.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/version.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+
+#include "hid-procon.h"
 
 #define VENDOR_ID_NINTENDO			0x057e
 #define DEVICE_ID_NINTENDO_JOYCON_L	0x2006
@@ -15,6 +29,14 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Dan: https://github.com/dan611");
 MODULE_DESCRIPTION("Driver for Nintendo Switch Pro Controller");
 
+static bool shm;
+module_param(shm, bool, 0444);
+MODULE_PARM_DESC(shm, "Expose each controller's latest state as an mmap-able page at /dev/proconN");
+
+static unsigned int idle_timeout = 300;
+module_param(idle_timeout, uint, 0644);
+MODULE_PARM_DESC(idle_timeout, "Seconds without input before a controller drops to simple reports with the IMU off, 0 to disable");
+
 #define PROCON_REPORT_SEND_USB		0x80
 #define PROCON_REPORT_REPLY_USB		0x81
 #define PROCON_REPORT_REPLY			0x21
@@ -45,6 +67,35 @@ MODULE_DESCRIPTION("Driver for Nintendo Switch Pro Controller");
 
 #define PROCON_EVENT_TOGGLE_GYRO	0xFF
 
+// how long replayed commands wait for the controller's acknowledgement
+#define PROCON_ACK_TIMEOUT_MS		250
+
+// the controller counts as at rest over a window of PROCON_GYRO_REST_SAMPLES
+// IMU samples, about two seconds at three per full report, when no gyroscope
+// word spread wider than PROCON_GYRO_REST_GYRO and no accelerometer word wider
+// than PROCON_GYRO_REST_ACCEL, so slow turns don't pass for drift
+#define PROCON_GYRO_REST_SAMPLES	384
+#define PROCON_GYRO_REST_GYRO		32
+#define PROCON_GYRO_REST_ACCEL		64
+// after each resting window the 24.8 fixed point bias moves 1/4 of the way to
+// the window's mean
+#define PROCON_GYRO_BIAS_SHIFT		2
+
+// the timer byte of full input reports ticks roughly every 5ms
+#define PROCON_TIMER_TICK_US		5000
+
+// stick movement smaller than this doesn't count as activity
+#define PROCON_IDLE_DEADZONE		0x1000
+
+#define PROCON_FF_EFFECTS			16
+// effects are rendered at the controller's full report interval
+#define PROCON_FF_PERIOD_NS			(15 * NSEC_PER_MSEC)
+
+// HD rumble frequencies, the low band spans 41-626Hz and the high band 82-1252Hz
+#define PROCON_RUMBLE_FREQ_MIN		41
+#define PROCON_RUMBLE_FREQ_LOW		160
+#define PROCON_RUMBLE_FREQ_HIGH		320
+
 static const struct hid_device_id procon_table [] =
 {
 	{ HID_USB_DEVICE(VENDOR_ID_NINTENDO, DEVICE_ID_NINTENDO_PROCON) },
@@ -55,6 +106,54 @@ static const struct hid_device_id procon_table [] =
 };
 MODULE_DEVICE_TABLE(hid, procon_table);
 
+struct procon_effect
+{
+	struct ff_effect effect;
+	ktime_t start;
+	int repeat;
+	bool playing;
+};
+
+struct procon_rumble
+{
+	u16 h_freq;
+	u16 h_amp;
+	u16 l_freq;
+	u16 l_amp;
+};
+
+enum procon_chords
+{
+	PROCON_CHORD_GYRO,
+	PROCON_CHORD_DPAD_LEFT,
+	PROCON_CHORD_DPAD_RIGHT,
+	PROCON_CHORDS
+};
+
+// buttons that have to be held, and only those among all chord buttons
+struct procon_chord
+{
+	u32 buttons;
+	unsigned hold_ms;
+};
+
+// button permutation applied during decode, one lookup per byte of the bitmask
+struct procon_remap
+{
+	struct rcu_head rcu;
+	s8 map[PROCON_BTN_COUNT];
+	u32 lut[3][256];
+};
+
+struct procon_shmdev
+{
+	struct kref kref;
+	struct miscdevice misc;
+	struct page *page;
+	char name[16];
+	int id;
+};
+
 struct procon_data
 {
 	struct list_head list;
@@ -64,26 +163,91 @@ struct procon_data
 	struct work_struct worker_connect;
 	struct work_struct worker_event;
 	struct work_struct worker_rumble;
+	struct work_struct worker_resume;
 
 	enum modes { PROCON_MODE_SIMPLE, PROCON_MODE_FULL, PROCON_MODE_GYRO } mode, mode_new;
 	int analog_dpad,
 		gyro_trigger;
 	bool connected;
+	bool restore;
 	int order;
-	u16 rumble_strong;
-	u16 rumble_weak;
-	
+
+	struct procon_effect effects[PROCON_FF_EFFECTS];
+	struct hrtimer ff_timer;
+	u16 ff_gain;
+	struct procon_rumble rumble;
+	u8 rumble_count;
+
 	struct power_supply *battery;
 	struct power_supply_desc battery_desc;
 
 	u8 event_cmd;
-	u64 time;
+
+	struct procon_chord chords[PROCON_CHORDS];
+	struct hrtimer chord_timer;
+	u32 chord_mask;
+	u32 chord_buttons;
+	int chord_pending;
+	bool chord_fired;
+	struct procon_remap __rcu *remap;
+	bool stopped;	// suspended or being removed, nothing may re-arm timers
+
+	struct completion ack;
+	u8 ack_cmd;
+
+	// hidraw output is filtered by ll_shim, the driver's own passes through
+	const struct hid_ll_driver *ll_driver;
+	struct hid_ll_driver ll_shim;
+	struct mutex send_mutex;
+	struct task_struct *send_task;
+	bool hidraw_exclusive;
+	u8 hidraw_cmd;		// subcommand sent through hidraw awaiting its ack
+	u8 hidraw_arg;
+	unsigned long hidraw_time;
+
+	struct procon_shmdev *shmdev;
+	struct procon_shm *shm_page;
+
+	u8 timer;
+	bool timer_valid;
+	u32 timer_us;
+
+	s32 gyro_bias[3];
+	s16 imu_min[6];		// accelerometer then gyroscope words over the window
+	s16 imu_max[6];
+	s32 gyro_sum[3];
+	int gyro_rest;		// samples in the window so far
+
+	struct delayed_work worker_idle;
+	struct work_struct worker_wake;
+	unsigned int idle_timeout;	// seconds, 0 never idles
+	unsigned long idle_last;	// jiffies of the last button or stick change
+	bool idle;
+	bool idle_waking;
+	u8 idle_report;		// report type the reference below came from
+	enum modes idle_mode;		// mode to restore on wake
+	u32 idle_buttons;
+	s16 idle_axes[4];
+	s64 idle_wake_us;
 
 	spinlock_t		lock;
-	struct mutex	mutex;
+	struct mutex	mutex;	// serialises command sequences against hidraw
 } *connections[8];
 
+// state remembered across reconnects, keyed by the controller's bluetooth
+// address. Wired controllers all report the same serial, so they aren't kept
+static struct procon_state
+{
+	char uniq[64];
+	bool gyro;
+	int analog_dpad,
+		gyro_trigger;
+	s32 gyro_bias[3];
+} states[8];
+static int states_next;
+
 static DEFINE_MUTEX(connections_lock);
+static DEFINE_IDA(procon_ida);
 
 static const int ledmap[] =
 {
@@ -97,6 +261,86 @@ static const int ledmap[] =
 	0b0110,
 };
 
+static const unsigned short keymap[PROCON_BTN_COUNT] =
+{
+	[PROCON_BTN_A] =			BTN_A,
+	[PROCON_BTN_B] =			BTN_B,
+	[PROCON_BTN_X] =			BTN_X,
+	[PROCON_BTN_Y] =			BTN_Y,
+	[PROCON_BTN_TL] =			BTN_TL,
+	[PROCON_BTN_TR] =			BTN_TR,
+	[PROCON_BTN_TL2] =			BTN_TL2,
+	[PROCON_BTN_TR2] =			BTN_TR2,
+	[PROCON_BTN_SELECT] =		BTN_SELECT,
+	[PROCON_BTN_START] =		BTN_START,
+	[PROCON_BTN_MODE] =			BTN_MODE,
+	[PROCON_BTN_EXTRA] =		BTN_EXTRA,
+	[PROCON_BTN_THUMBL] =		BTN_THUMBL,
+	[PROCON_BTN_THUMBR] =		BTN_THUMBR,
+	[PROCON_BTN_DPAD_UP] =		BTN_DPAD_UP,
+	[PROCON_BTN_DPAD_DOWN] =	BTN_DPAD_DOWN,
+	[PROCON_BTN_DPAD_LEFT] =	BTN_DPAD_LEFT,
+	[PROCON_BTN_DPAD_RIGHT] =	BTN_DPAD_RIGHT,
+};
+
+#define PROCON_DPAD_BUTTONS (BIT(PROCON_BTN_DPAD_UP) | BIT(PROCON_BTN_DPAD_DOWN) | BIT(PROCON_BTN_DPAD_LEFT) | BIT(PROCON_BTN_DPAD_RIGHT))
+
+// byte and mask of each button in full input reports
+static const struct{u8 byte; u8 mask;} buttonmap_full[PROCON_BTN_COUNT] =
+{
+	[PROCON_BTN_A] =			{3, 0x08},
+	[PROCON_BTN_B] =			{3, 0x04},
+	[PROCON_BTN_X] =			{3, 0x02},
+	[PROCON_BTN_Y] =			{3, 0x01},
+	[PROCON_BTN_TL] =			{5, 0x40},
+	[PROCON_BTN_TR] =			{3, 0x40},
+	[PROCON_BTN_TL2] =			{5, 0x80},
+	[PROCON_BTN_TR2] =			{3, 0x80},
+	[PROCON_BTN_SELECT] =		{4, 0x01},
+	[PROCON_BTN_START] =		{4, 0x02},
+	[PROCON_BTN_MODE] =			{4, 0x10},
+	[PROCON_BTN_EXTRA] =		{4, 0x20},
+	[PROCON_BTN_THUMBL] =		{4, 0x08},
+	[PROCON_BTN_THUMBR] =		{4, 0x04},
+	[PROCON_BTN_DPAD_UP] =		{5, 0x02},
+	[PROCON_BTN_DPAD_DOWN] =	{5, 0x01},
+	[PROCON_BTN_DPAD_LEFT] =	{5, 0x08},
+	[PROCON_BTN_DPAD_RIGHT] =	{5, 0x04},
+};
+
+// simple input reports carry the d-pad as a hat in byte 3
+static const struct{u8 byte; u8 mask;} buttonmap_simple[PROCON_BTN_DPAD_UP] =
+{
+	[PROCON_BTN_A] =			{1, 0x02},
+	[PROCON_BTN_B] =			{1, 0x01},
+	[PROCON_BTN_X] =			{1, 0x08},
+	[PROCON_BTN_Y] =			{1, 0x04},
+	[PROCON_BTN_TL] =			{1, 0x10},
+	[PROCON_BTN_TR] =			{1, 0x20},
+	[PROCON_BTN_TL2] =			{1, 0x40},
+	[PROCON_BTN_TR2] =			{1, 0x80},
+	[PROCON_BTN_SELECT] =		{2, 0x01},
+	[PROCON_BTN_START] =		{2, 0x02},
+	[PROCON_BTN_MODE] =			{2, 0x10},
+	[PROCON_BTN_EXTRA] =		{2, 0x20},
+	[PROCON_BTN_THUMBL] =		{2, 0x04},
+	[PROCON_BTN_THUMBR] =		{2, 0x08},
+};
+
+static const struct procon_chord chords_default[PROCON_CHORDS] =
+{
+	[PROCON_CHORD_GYRO] =		{BIT(PROCON_BTN_MODE), 2000},
+	[PROCON_CHORD_DPAD_LEFT] =	{BIT(PROCON_BTN_MODE) | BIT(PROCON_BTN_THUMBL), 2000},
+	[PROCON_CHORD_DPAD_RIGHT] =	{BIT(PROCON_BTN_MODE) | BIT(PROCON_BTN_THUMBR), 2000},
+};
+
+static const char * const chord_names[PROCON_CHORDS] =
+{
+	[PROCON_CHORD_GYRO] =		"gyro",
+	[PROCON_CHORD_DPAD_LEFT] =	"dpad_left",
+	[PROCON_CHORD_DPAD_RIGHT] =	"dpad_right",
+};
+
 static const struct{bool up; bool right; bool down; bool left;} hatmap[] =
 {
 	{true,	false,	false,	false},
@@ -110,8 +354,33 @@ static const struct{bool up; bool right; bool down; bool left;} hatmap[] =
 	{false,	false,	false,	false}
 };
 
+// 2^(n/32) in 16.16 fixed point, used to find HD rumble frequency codes
+static const u32 rumble_freqmap[] =
+{
+	0x10000, 0x1059B, 0x10B56, 0x11130, 0x1172C, 0x11D48, 0x12388, 0x129EA,
+	0x13070, 0x1371A, 0x13DEA, 0x144E1, 0x14BFE, 0x15343, 0x15AB0, 0x16248,
+	0x16A0A, 0x171F7, 0x17A11, 0x18259, 0x18ACE, 0x19373, 0x19C49, 0x1A550,
+	0x1AE8A, 0x1B7F7, 0x1C19A, 0x1CB72, 0x1D582, 0x1DFC9, 0x1EA4B, 0x1F507,
+	0x20000,
+};
+
+// the driver's own reports go through hid_hw_* like anyone else's, marked
+// with the sending task so the ll_driver shim lets them straight through
+static void procon_send_begin(struct procon_data *drvdata)
+{
+	mutex_lock(&drvdata->send_mutex);
+	WRITE_ONCE(drvdata->send_task, current);
+}
+
+static void procon_send_end(struct procon_data *drvdata)
+{
+	WRITE_ONCE(drvdata->send_task, NULL);
+	mutex_unlock(&drvdata->send_mutex);
+}
+
 static int procon_send_report(struct hid_device *hdev, u8 *data, int size)
 {
+	struct procon_data *drvdata = hid_get_drvdata(hdev);
 	struct hid_report *rep;
 	unsigned id = data[0];
 	u8 *buf;
@@ -129,12 +398,18 @@ static int procon_send_report(struct hid_device *hdev, u8 *data, int size)
 
 		memcpy(buf, data, size);
 
+		procon_send_begin(drvdata);
 		retval = hid_hw_raw_request(hdev, id, buf, size, HID_OUTPUT_REPORT, HID_REQ_SET_REPORT);
+		procon_send_end(drvdata);
 		
 		kfree(buf);
 	}
 	else
+	{
+		procon_send_begin(drvdata);
 		retval = hid_hw_output_report(hdev, data, size);
+		procon_send_end(drvdata);
+	}
 
 	//~ if(retval > -1)
 		//~ hid_info(hdev,"Sent %d bytes (%*ph)\n", retval, size, data);
@@ -152,10 +427,21 @@ static int procon_send_cmd_usb(struct hid_device *hdev, int cmd)
 
 static int procon_send_data(struct hid_device *hdev, u8 *data, int size)
 {
+	struct procon_data *drvdata = hid_get_drvdata(hdev);
+	unsigned long flags;
 	int retval;
 	u8 buf[64] = {PROCON_REPORT_SEND_USB, PROCON_USB_DO_CMD, 0x00, 0x31, 0x00, 0x00, 0x00, 0x00};
 	memcpy(buf + 8, data, size);
 
+	// the next ack of this subcommand is the driver's own
+	if(data[0] == PROCON_CMD_AND_RUMBLE)
+	{
+		spin_lock_irqsave(&drvdata->lock, flags);
+		if(drvdata->hidraw_cmd == data[10])
+			drvdata->hidraw_cmd = 0;
+		spin_unlock_irqrestore(&drvdata->lock, flags);
+	}
+
 	if(hdev->bus == BUS_USB)
 		retval = procon_send_report(hdev, buf, 64);
 	else
@@ -183,6 +469,179 @@ static int procon_send_cmd(struct hid_device *hdev, u8 cmd, u8 arg)
 	return procon_send_data(hdev, data, 12);
 }
 
+static int procon_send_homelight(struct hid_device *hdev, bool gyro)
+{
+	u8 data[34] =
+	{
+		PROCON_CMD_AND_RUMBLE,
+		0x00,
+		0x00,
+		0x90,
+		0x20,
+		0x64,
+		0x00,
+		0x90,
+		0x20,
+		0x64,
+		PROCON_CMD_LED_HOME,
+		0x0F,
+		gyro? 0x20 : 0x21,
+		0x20,
+	};
+	return procon_send_data(hdev, data, 34);
+}
+
+// the next acknowledgement of cmd completes drvdata->ack instead of being
+// handled by procon_work_event
+static void procon_expect_ack(struct procon_data *drvdata, u8 cmd)
+{
+	unsigned long flags;
+
+	reinit_completion(&drvdata->ack);
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->ack_cmd = cmd;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+}
+
+static int procon_wait_ack(struct procon_data *drvdata)
+{
+	unsigned long flags;
+	int retval = 0;
+
+	if(!wait_for_completion_timeout(&drvdata->ack, msecs_to_jiffies(PROCON_ACK_TIMEOUT_MS)))
+		retval = -ETIMEDOUT;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->ack_cmd = 0;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+	return retval;
+}
+
+static int procon_send_cmd_sync(struct procon_data *drvdata, u8 cmd, u8 arg)
+{
+	int retval;
+
+	procon_expect_ack(drvdata, cmd);
+	retval = procon_send_cmd(drvdata->hdev, cmd, arg);
+	if(retval < 0)
+		return retval;
+	return procon_wait_ack(drvdata);
+}
+
+// take the first free player slot, returns false if already connected
+static bool procon_connect(struct procon_data *drvdata)
+{
+	struct hid_device *hdev = drvdata->hdev;
+	int order;
+
+	mutex_lock(&connections_lock);
+	if(drvdata->connected)
+	{
+		mutex_unlock(&connections_lock);
+		return false;
+	}
+
+	drvdata->connected = true;
+	for(order = 0;order < 8;order++)
+		if(connections[order] == NULL)
+		{
+			connections[order] = drvdata;
+			break;
+		}
+	// out of slots, share the last LED pattern
+	if(order == 8)
+		order--;
+	drvdata->order = order;
+	hid_info(hdev, hdev->bus == BUS_USB? "Pro Controller (Wired) #%d connected\n"  : "Pro Controller (Wireless) #%d connected\n", order + 1);
+	mutex_unlock(&connections_lock);
+
+	return true;
+}
+
+// give back a slot taken by procon_connect
+static void procon_disconnect(struct procon_data *drvdata)
+{
+	mutex_lock(&connections_lock);
+	if(connections[drvdata->order] == drvdata)
+		connections[drvdata->order] = NULL;
+	drvdata->connected = false;
+	mutex_unlock(&connections_lock);
+}
+
+// bring the controller back to the driver's cached mode, gyro and LED state in
+// one burst of acknowledged commands rather than the step by step handshake
+static int procon_replay_cmds(struct procon_data *drvdata)
+{
+	struct hid_device *hdev = drvdata->hdev;
+	ktime_t start = ktime_get();
+	unsigned long flags;
+	enum modes mode;
+	bool gyro;
+	bool claimed;
+	int retval;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	mode = drvdata->mode_new;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+	gyro = mode == PROCON_MODE_GYRO;
+
+	if(hdev->bus == BUS_USB)
+	{
+		procon_send_cmd_usb(hdev, PROCON_USB_ENABLE);
+		procon_send_cmd_usb(hdev, PROCON_USB_HANDSHAKE);
+	}
+
+	retval = procon_send_cmd_sync(drvdata, PROCON_CMD_MODE, mode == PROCON_MODE_SIMPLE? PROCON_ARG_INPUT_SIMPLE : PROCON_ARG_INPUT_FULL);
+	if(retval)
+		return retval;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->mode = gyro? PROCON_MODE_FULL : mode;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	if(gyro)
+	{
+		retval = procon_send_cmd_sync(drvdata, PROCON_CMD_GYRO, true);
+		if(retval)
+			return retval;
+	}
+
+	// a slot claimed here is handed back on failure, so the handshake that
+	// follows claims it again and sends the player LED
+	claimed = procon_connect(drvdata);
+	retval = procon_send_cmd_sync(drvdata, PROCON_CMD_LED, ledmap[drvdata->order]);
+	if(!retval)
+	{
+		procon_expect_ack(drvdata, PROCON_CMD_LED_HOME);
+		procon_send_homelight(hdev, gyro);
+		retval = procon_wait_ack(drvdata);
+	}
+	if(retval)
+	{
+		if(claimed)
+			procon_disconnect(drvdata);
+		return retval;
+	}
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->mode = mode;
+	drvdata->mode_new = mode;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	hid_info(hdev, "Pro Controller #%d restored in %lldus\n", drvdata->order + 1, ktime_us_delta(ktime_get(), start));
+	return 0;
+}
+
+static int procon_replay(struct procon_data *drvdata)
+{
+	int retval;
+
+	mutex_lock(&drvdata->mutex);
+	retval = procon_replay_cmds(drvdata);
+	mutex_unlock(&drvdata->mutex);
+	return retval;
+}
+
 static void procon_work_connect(struct work_struct *work)
 {
 	struct procon_data *drvdata = container_of(work, struct procon_data, worker_connect);
@@ -192,6 +651,15 @@ static void procon_work_connect(struct work_struct *work)
 
 	//~ hid_info(hdev, "procon_work_connect\n");
 
+	// a controller seen before skips the handshake and gets its state back
+	if(drvdata->restore)
+	{
+		drvdata->restore = false;
+		if(!procon_replay(drvdata))
+			return;
+		hid_warn(hdev, "Could not restore controller state, reconnecting\n");
+	}
+
 	if(hdev->bus == BUS_USB)
 	{
 		procon_send_cmd_usb(hdev, PROCON_USB_ENABLE);
@@ -221,26 +689,10 @@ static void procon_work_event(struct work_struct *work)
 	u8 mode_new;
 	u8 order;
 	u8 event;
-	u8 data_homelight[34] =
-	{
-		PROCON_CMD_AND_RUMBLE,
-		0x00,
-		0x00,
-		0x90,
-		0x20,
-		0x64,
-		0x00,
-		0x90,
-		0x20,
-		0x64,
-		PROCON_CMD_LED_HOME,
-		0x0F,
-		0xF1,
-		0x20,
-	};
 	
 	//~ hid_info(hdev, "procon_work_event %d\n", event);
 
+	mutex_lock(&drvdata->mutex);
 	spin_lock_irqsave(&drvdata->lock, flags);
 	order = drvdata->order;
 	event = drvdata->event_cmd;
@@ -253,28 +705,8 @@ static void procon_work_event(struct work_struct *work)
 	{
 	case PROCON_CMD_MODE:
 		// input mode set, ready to set the connection LED
-		mutex_lock(&connections_lock);
-		if(!drvdata->connected)
-		{
-			drvdata->connected = true;
-			//~ drvdata->analog_dpad = 0;
-			//~ drvdata->gyro_trigger = 0;
-			for(order = 0;order < 8;order++)
-				if(connections[order] == NULL)
-				{
-					drvdata->order = order;
-					connections[order] = drvdata;
-					break;
-				}
-			if(order == 9)
-			{
-				order--;
-				drvdata->order = order;
-			}
-			hid_info(hdev, hdev->bus == BUS_USB? "Pro Controller (Wired) #%d connected\n"  : "Pro Controller (Wireless) #%d connected\n", order + 1);
-			procon_send_cmd(hdev, PROCON_CMD_LED, ledmap[order]);
-		}
-		mutex_unlock(&connections_lock);
+		if(procon_connect(drvdata))
+			procon_send_cmd(hdev, PROCON_CMD_LED, ledmap[drvdata->order]);
 		
 		// wireless has switched to full mode, enable gyro
 		if(mode == PROCON_MODE_SIMPLE && mode_new == PROCON_MODE_GYRO)
@@ -283,10 +715,7 @@ static void procon_work_event(struct work_struct *work)
 			mode_new = PROCON_MODE_FULL;
 		}
 		else if(mode == PROCON_MODE_GYRO && mode_new == PROCON_MODE_SIMPLE)
-		{
-			data_homelight[12] = 0x21;
-			procon_send_data(hdev, data_homelight, 34);
-		}
+			procon_send_homelight(hdev, false);
 
 		spin_lock_irqsave(&drvdata->lock, flags);
 		drvdata->mode = mode_new;
@@ -301,8 +730,7 @@ static void procon_work_event(struct work_struct *work)
 			drvdata->mode = drvdata->mode_new;
 			spin_unlock_irqrestore(&drvdata->lock, flags);
 
-			data_homelight[12] = mode_new == PROCON_MODE_GYRO? 0x20 : 0x21;
-			procon_send_data(hdev, data_homelight, 34);
+			procon_send_homelight(hdev, mode_new == PROCON_MODE_GYRO);
 		}
 		else
 			procon_send_cmd(hdev, PROCON_CMD_MODE, PROCON_ARG_INPUT_SIMPLE);
@@ -336,10 +764,7 @@ static void procon_work_event(struct work_struct *work)
 	case PROCON_CMD_LED:
 		// controller may have been unplugged and reconnected, update the home light accordingly
 		if(mode != PROCON_MODE_GYRO)
-		{
-			data_homelight[12] = 0x21;
-			procon_send_data(hdev, data_homelight, 34);
-		}
+			procon_send_homelight(hdev, false);
 		break;
 		
 	case PROCON_CMD_LED_HOME:
@@ -347,116 +772,1298 @@ static void procon_work_event(struct work_struct *work)
 		procon_send_cmd(hdev, 0x00, 0x00);
 		break;
 	}
+	mutex_unlock(&drvdata->mutex);
 }
 
-static void procon_work_rumble(struct work_struct *work)
+static void procon_work_resume(struct work_struct *work)
 {
-	struct procon_data *drvdata = container_of(work, struct procon_data, worker_rumble);
-	struct hid_device *hdev = drvdata->hdev;
-	unsigned long flags;
+	struct procon_data *drvdata = container_of(work, struct procon_data, worker_resume);
+	int retval;
 
-	u8 data[12] = {PROCON_CMD_RUMBLE_ONLY, 0x00};
+	retval = procon_replay(drvdata);
+	if(retval)
+		hid_err(drvdata->hdev, "Could not restore controller state (error %d)\n", retval);
+}
 
-	u8 h_freq = 0x20;
-	u8 l_freq = 0x28;
-	u8 h_amp;
-	u8 l_amp1;
-	u8 l_amp2;
+static void procon_idle_schedule(struct procon_data *drvdata, unsigned long delay)
+{
+	unsigned long flags;
 
 	spin_lock_irqsave(&drvdata->lock, flags);
-	h_amp = (drvdata->rumble_weak / 649) * 2;
-	l_amp1 = (drvdata->rumble_strong / 649);
+	if(READ_ONCE(drvdata->idle_timeout) && !drvdata->stopped)
+		mod_delayed_work(system_wq, &drvdata->worker_idle, delay);
 	spin_unlock_irqrestore(&drvdata->lock, flags);
-	l_amp2 = ((l_amp1 % 2) * 128);
-	l_amp1 = (l_amp1 / 2) + 64;
-
-	data[2] = data[6] = h_freq;
-	data[4] = data[9] = l_freq;
-	
-	data[3] = data[7] = h_amp;
-	data[4] = data[8] += l_amp2;
-	data[5] = data[9] = l_amp1;
-
-	//~ hid_info(hdev,"RUMBLE (%04hX %04hX) -> (%*ph)\n", drvdata->rumble_weak, drvdata->rumble_strong, 8, data);
-	procon_send_data(hdev, data, 12);
 }
 
-static int procon_play(struct input_dev *input, void *data, struct ff_effect *effect)
+// called from raw_event with the physical buttons and sticks, wakes an idle
+// controller on the first change
+static void procon_idle_update(struct procon_data *drvdata, u8 report, u32 buttons, s16 x, s16 y, s16 rx, s16 ry)
 {
-	struct procon_data *drvdata = input_get_drvdata(input);
+	s16 axes[4] = {x, y, rx, ry};
+	unsigned long flags;
+	bool baseline;
+	bool active;
+	int i;
 
-	if(effect->type == FF_RUMBLE)
+	spin_lock_irqsave(&drvdata->lock, flags);
+	// the first report of another type only sets the reference, simple and
+	// full reports don't scale the sticks quite the same
+	baseline = drvdata->idle_report == report;
+	active = baseline && buttons != drvdata->idle_buttons;
+	for(i = 0;i < 4;i++)
+		active |= baseline && abs(axes[i] - drvdata->idle_axes[i]) > PROCON_IDLE_DEADZONE;
+	// once idling in simple mode the controller only reports changes, so
+	// every simple report is the user's doing
+	active |= drvdata->idle && drvdata->mode == PROCON_MODE_SIMPLE && report == PROCON_REPORT_INPUT_SIMPLE;
+
+	if(active || !baseline)
 	{
-		drvdata->rumble_weak = effect->u.rumble.weak_magnitude;
-		drvdata->rumble_strong = effect->u.rumble.strong_magnitude;
-		schedule_work(&drvdata->worker_rumble);
+		drvdata->idle_buttons = buttons;
+		memcpy(drvdata->idle_axes, axes, sizeof(drvdata->idle_axes));
+		drvdata->idle_report = report;
 	}
-	return 0;
+	if(active)
+	{
+		drvdata->idle_last = jiffies;
+		if(drvdata->idle && !drvdata->idle_waking && !drvdata->stopped)
+		{
+			drvdata->idle_waking = true;
+			schedule_work(&drvdata->worker_wake);
+		}
+	}
+	spin_unlock_irqrestore(&drvdata->lock, flags);
 }
 
-static int procon_input_register(struct procon_data *drvdata)
+// once idle_timeout passes without input, stop the IMU and on bluetooth fall
+// back to simple reports, which the controller only sends on change
+static void procon_work_idle(struct work_struct *work)
 {
+	struct procon_data *drvdata = container_of(work, struct procon_data, worker_idle.work);
 	struct hid_device *hdev = drvdata->hdev;
-	struct input_dev *input = input_allocate_device();
-	int retval;
+	unsigned long timeout = READ_ONCE(drvdata->idle_timeout) * HZ;
+	unsigned long flags;
+	unsigned long last;
+	enum modes mode;
+	bool connected;
+	bool idle;
+	int retval = 0;
 
-	//~ hid_info(hdev, "procon_input_register");
+	if(!timeout)
+		return;
 
-	if(!input)
-		return -ENOMEM;
-	
-	input_set_drvdata(input, drvdata);
-	input->name = hdev->bus == BUS_USB? "Pro Controller (Wired)"  : "Pro Controller (Wireless)";
-	input->id.bustype = hdev->bus;
-	input->id.vendor = hdev->vendor;
-	input->id.product = hdev->product;
-	input->id.version = hdev->version;
-	input->dev.parent = &hdev->dev;
+	spin_lock_irqsave(&drvdata->lock, flags);
+	last = drvdata->idle_last;
+	mode = drvdata->mode;
+	connected = drvdata->connected && drvdata->mode == drvdata->mode_new;
+	idle = drvdata->idle;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
 
-	input_set_capability(input, EV_KEY, BTN_A);
-	input_set_capability(input, EV_KEY, BTN_B);
-	input_set_capability(input, EV_KEY, BTN_X);
-	input_set_capability(input, EV_KEY, BTN_Y);
-	input_set_capability(input, EV_KEY, BTN_TL);
-	input_set_capability(input, EV_KEY, BTN_TR);
-	input_set_capability(input, EV_KEY, BTN_TL2);
-	input_set_capability(input, EV_KEY, BTN_TR2);
-	input_set_capability(input, EV_KEY, BTN_SELECT);
-	input_set_capability(input, EV_KEY, BTN_START);
-	input_set_capability(input, EV_KEY, BTN_MODE);
-	input_set_capability(input, EV_KEY, BTN_EXTRA);
-	input_set_capability(input, EV_KEY, BTN_THUMBL);
-	input_set_capability(input, EV_KEY, BTN_THUMBR);
-	input_set_capability(input, EV_KEY, BTN_DPAD_UP);
-	input_set_capability(input, EV_KEY, BTN_DPAD_DOWN);
-	input_set_capability(input, EV_KEY, BTN_DPAD_LEFT);
-	input_set_capability(input, EV_KEY, BTN_DPAD_RIGHT);
-	input_set_capability(input, EV_FF, FF_RUMBLE);
-	input_set_abs_params(input, ABS_X, -0x7FFF, 0x7FFF, 0, 0x7FF);
-	input_set_abs_params(input, ABS_Y, -0x7FFF, 0x7FFF, 0, 0x7FF);
-	input_set_abs_params(input, ABS_RX, -0x7FFF, 0x7FFF, 0, 0x7FF);
-	input_set_abs_params(input, ABS_RY, -0x7FFF, 0x7FFF, 0, 0x7FF);
-	input_set_abs_params(input, ABS_TILT_X, -0x7FFF, 0x7FFF, 0x0F, 0);
-	input_set_abs_params(input, ABS_TILT_Y, -0x7FFF, 0x7FFF, 0x0F, 0);
-	
-	retval = input_register_device(input);
-	if(retval)
-		goto error;
-	else
+	// waking up reschedules
+	if(idle)
+		return;
+
+	if(time_before(jiffies, last + timeout))
+	{
+		procon_idle_schedule(drvdata, last + timeout - jiffies);
+		return;
+	}
+
+	// nothing to save, or still setting up or playing an effect
+	if(!connected || hrtimer_active(&drvdata->ff_timer) ||
+	   (mode == PROCON_MODE_SIMPLE) || (mode == PROCON_MODE_FULL && hdev->bus == BUS_USB))
+	{
+		procon_idle_schedule(drvdata, timeout);
+		return;
+	}
+
+	mutex_lock(&drvdata->mutex);
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->idle = true;
+	drvdata->idle_waking = false;
+	drvdata->idle_mode = mode;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	if(mode == PROCON_MODE_GYRO)
+	{
+		retval = procon_send_cmd_sync(drvdata, PROCON_CMD_GYRO, false);
+		if(!retval)
+		{
+			spin_lock_irqsave(&drvdata->lock, flags);
+			drvdata->mode = PROCON_MODE_FULL;
+			drvdata->mode_new = PROCON_MODE_FULL;
+			spin_unlock_irqrestore(&drvdata->lock, flags);
+		}
+	}
+
+	// USB needs full reports
+	if(!retval && hdev->bus != BUS_USB)
+	{
+		retval = procon_send_cmd_sync(drvdata, PROCON_CMD_MODE, PROCON_ARG_INPUT_SIMPLE);
+		if(!retval)
+		{
+			spin_lock_irqsave(&drvdata->lock, flags);
+			drvdata->mode = PROCON_MODE_SIMPLE;
+			drvdata->mode_new = PROCON_MODE_SIMPLE;
+			drvdata->timer_valid = false;
+			spin_unlock_irqrestore(&drvdata->lock, flags);
+		}
+	}
+	mutex_unlock(&drvdata->mutex);
+
+	if(retval)
+	{
+		hid_warn(hdev, "Could not enter idle mode (error %d)\n", retval);
+		spin_lock_irqsave(&drvdata->lock, flags);
+		if(!drvdata->stopped)
+			schedule_work(&drvdata->worker_wake);
+		spin_unlock_irqrestore(&drvdata->lock, flags);
+	}
+	else
+		hid_dbg(hdev, "Pro Controller #%d idle\n", drvdata->order + 1);
+}
+
+static void procon_work_wake(struct work_struct *work)
+{
+	struct procon_data *drvdata = container_of(work, struct procon_data, worker_wake);
+	struct hid_device *hdev = drvdata->hdev;
+	ktime_t start = ktime_get();
+	unsigned long flags;
+	enum modes mode, idle_mode;
+	bool idle;
+	s64 wake_us;
+	int retval = 0;
+
+	mutex_lock(&drvdata->mutex);
+	spin_lock_irqsave(&drvdata->lock, flags);
+	mode = drvdata->mode;
+	idle_mode = drvdata->idle_mode;
+	idle = drvdata->idle;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	if(!idle)
+		goto out;
+
+	if(idle_mode != PROCON_MODE_SIMPLE && mode == PROCON_MODE_SIMPLE)
+	{
+		retval = procon_send_cmd_sync(drvdata, PROCON_CMD_MODE, PROCON_ARG_INPUT_FULL);
+		if(retval)
+			goto out;
+		mode = PROCON_MODE_FULL;
+	}
+
+	if(idle_mode == PROCON_MODE_GYRO && mode == PROCON_MODE_FULL)
+	{
+		spin_lock_irqsave(&drvdata->lock, flags);
+		drvdata->mode = PROCON_MODE_FULL;
+		spin_unlock_irqrestore(&drvdata->lock, flags);
+
+		retval = procon_send_cmd_sync(drvdata, PROCON_CMD_GYRO, true);
+		if(retval)
+			goto out;
+	}
+	wake_us = ktime_us_delta(ktime_get(), start);
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->mode = idle_mode;
+	drvdata->mode_new = idle_mode;
+	drvdata->idle = false;
+	drvdata->idle_last = jiffies;
+	drvdata->idle_wake_us = wake_us;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	hid_dbg(hdev, "Pro Controller #%d woke in %lldus\n", drvdata->order + 1, wake_us);
+
+out:
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->idle_waking = false;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+	mutex_unlock(&drvdata->mutex);
+
+	// the next change tries again
+	if(retval)
+		hid_warn(hdev, "Could not restore mode after idle (error %d)\n", retval);
+	else
+		procon_idle_schedule(drvdata, READ_ONCE(drvdata->idle_timeout) * HZ);
+}
+
+// round(32 * log2(freq / 10)), the base of both HD rumble frequency encodings
+static int procon_rumble_freq(unsigned freq)
+{
+	u32 x = (freq << 16) / 10;
+	int exp;
+	int n;
+
+	if(x < 0x10000)
+		return 0;
+
+	exp = ilog2(x) - 16;
+	x >>= exp;
+	for(n = 0;n < 32 && x > (rumble_freqmap[n] + rumble_freqmap[n + 1]) / 2;n++);
+
+	return exp * 32 + n;
+}
+
+static void procon_rumble_encode(u8 *data, const struct procon_rumble *rumble)
+{
+	u16 h_freq = (clamp(procon_rumble_freq(rumble->h_freq), 0x60, 0xDF) - 0x60) * 4;
+	u8 l_freq = clamp(procon_rumble_freq(rumble->l_freq), 0x40, 0xBF) - 0x40;
+	u8 h_amp = (rumble->h_amp / 649) * 2;
+	u8 l_amp = rumble->l_amp / 649;
+
+	data[0] = h_freq & 0xFF;
+	data[1] = h_amp + (h_freq >> 8);
+	data[2] = l_freq + ((l_amp % 2) * 128);
+	data[3] = (l_amp / 2) + 64;
+}
+
+static void procon_work_rumble(struct work_struct *work)
+{
+	struct procon_data *drvdata = container_of(work, struct procon_data, worker_rumble);
+	struct hid_device *hdev = drvdata->hdev;
+	struct procon_rumble rumble;
+	unsigned long flags;
+
+	u8 data[12] = {PROCON_CMD_RUMBLE_ONLY, 0x00};
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	rumble = drvdata->rumble;
+	data[1] = drvdata->rumble_count++ & 0x0F;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	// both actuators play the same waveform
+	procon_rumble_encode(data + 2, &rumble);
+	procon_rumble_encode(data + 6, &rumble);
+
+	//~ hid_info(hdev,"RUMBLE (%hu@%hu %hu@%hu) -> (%*ph)\n", rumble.h_amp, rumble.h_freq, rumble.l_amp, rumble.l_freq, 8, data + 2);
+	procon_send_data(hdev, data, 12);
+}
+
+// attack and fade an effect's 0-0x7FFF level, t is the time into the effect in ms
+static int procon_ff_envelope(const struct ff_envelope *envelope, u16 length, int t, int level)
+{
+	int remaining = length - t;
+
+	level = min(level, 0x7FFF);
+
+	if(envelope->attack_length && t < envelope->attack_length)
+		return envelope->attack_level + (level - (int) envelope->attack_level) * t / envelope->attack_length;
+
+	if(length && envelope->fade_length && remaining < envelope->fade_length)
+		return envelope->fade_level + (level - (int) envelope->fade_level) * remaining / envelope->fade_length;
+
+	return level;
+}
+
+static int procon_ff_wave(u16 waveform, int t, u16 period)
+{
+	int deg = (t % period) * 360 / period;
+
+	switch(waveform)
+	{
+	case FF_SQUARE:
+		return deg < 180? 0x7FFF : -0x7FFF;
+	case FF_TRIANGLE:
+		return deg < 180? 0x7FFF - deg * 0xFFFE / 180 : (deg - 180) * 0xFFFE / 180 - 0x7FFF;
+	case FF_SAW_UP:
+		return deg * 0xFFFE / 360 - 0x7FFF;
+	case FF_SAW_DOWN:
+		return 0x7FFF - deg * 0xFFFE / 360;
+	default:
+		return fixp_sin16(deg);
+	}
+}
+
+// mix every playing effect into one rumble state, returns false once nothing
+// is left playing or waiting out its delay
+static bool procon_ff_render(struct procon_data *drvdata, ktime_t now, struct procon_rumble *rumble)
+{
+	u32 h_amp = 0,
+		l_amp = 0,
+		h_max = 0,
+		l_max = 0;
+	bool active = false;
+	int i;
+
+	rumble->h_freq = PROCON_RUMBLE_FREQ_HIGH;
+	rumble->l_freq = PROCON_RUMBLE_FREQ_LOW;
+
+	for(i = 0;i < PROCON_FF_EFFECTS;i++)
+	{
+		struct procon_effect *slot = &drvdata->effects[i];
+		struct ff_effect *effect = &slot->effect;
+		u32 h = 0,
+			l = 0;
+		u16 freq = 0;
+		int level;
+		s64 t;
+
+		if(!slot->playing)
+			continue;
+
+		active = true;
+		t = ktime_ms_delta(now, slot->start) - effect->replay.delay;
+		if(t < 0)
+			continue;
+
+		if(effect->replay.length && t >= effect->replay.length)
+		{
+			if(--slot->repeat > 0)
+				slot->start = now;
+			else
+				slot->playing = false;
+			continue;
+		}
+
+		switch(effect->type)
+		{
+		case FF_RUMBLE:
+			h = effect->u.rumble.weak_magnitude;
+			l = effect->u.rumble.strong_magnitude;
+			break;
+
+		case FF_CONSTANT:
+			level = procon_ff_envelope(&effect->u.constant.envelope, effect->replay.length, t, abs(effect->u.constant.level));
+			h = l = level * 2;
+			break;
+
+		case FF_PERIODIC:
+			level = procon_ff_envelope(&effect->u.periodic.envelope, effect->replay.length, t, abs(effect->u.periodic.magnitude));
+			if(effect->u.periodic.period)
+				freq = 1000 / effect->u.periodic.period;
+
+			// the actuators play audible frequencies themselves, put them on
+			// whichever band is closest
+			if(freq >= PROCON_RUMBLE_FREQ_MIN)
+			{
+				if(freq < PROCON_RUMBLE_FREQ_HIGH)
+					l = level * 2;
+				else
+					h = level * 2;
+				break;
+			}
+
+			// anything slower is modulated here, one step per timer tick, with
+			// the bottom of the wave at zero amplitude and the top at level
+			freq = 0;
+			if(effect->u.periodic.period)
+				level = (procon_ff_wave(effect->u.periodic.waveform, t, effect->u.periodic.period) + 0x7FFF) / 2 * level / 0x7FFF;
+			level += effect->u.periodic.offset;
+			h = l = clamp(level, 0, 0x7FFF) * 2;
+			break;
+		}
+
+		h = h * drvdata->ff_gain / 0xFFFF;
+		l = l * drvdata->ff_gain / 0xFFFF;
+		h_amp += h;
+		l_amp += l;
+
+		if(freq && h > h_max)
+		{
+			h_max = h;
+			rumble->h_freq = freq;
+		}
+		if(freq && l > l_max)
+		{
+			l_max = l;
+			rumble->l_freq = freq;
+		}
+	}
+
+	rumble->h_amp = min_t(u32, h_amp, 0xFFFF);
+	rumble->l_amp = min_t(u32, l_amp, 0xFFFF);
+
+	return active;
+}
+
+static enum hrtimer_restart procon_ff_timer(struct hrtimer *timer)
+{
+	struct procon_data *drvdata = container_of(timer, struct procon_data, ff_timer);
+	struct procon_rumble rumble;
+	unsigned long flags;
+	bool active;
+	bool changed;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	active = procon_ff_render(drvdata, ktime_get(), &rumble);
+	changed = memcmp(&rumble, &drvdata->rumble, sizeof(rumble));
+	drvdata->rumble = rumble;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	// only talk to the controller when the output actually changes
+	if(changed)
+		schedule_work(&drvdata->worker_rumble);
+
+	if(!active)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, ns_to_ktime(PROCON_FF_PERIOD_NS));
+	return HRTIMER_RESTART;
+}
+
+static int procon_ff_upload(struct input_dev *input, struct ff_effect *effect, struct ff_effect *old)
+{
+	struct procon_data *drvdata = input_get_drvdata(input);
+	unsigned long flags;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->effects[effect->id].effect = *effect;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	return 0;
+}
+
+static int procon_ff_erase(struct input_dev *input, int effect_id)
+{
+	struct procon_data *drvdata = input_get_drvdata(input);
+	unsigned long flags;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->effects[effect_id].playing = false;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	return 0;
+}
+
+static int procon_ff_playback(struct input_dev *input, int effect_id, int value)
+{
+	struct procon_data *drvdata = input_get_drvdata(input);
+	struct procon_effect *slot = &drvdata->effects[effect_id];
+	unsigned long flags;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	slot->playing = value > 0;
+	slot->repeat = value;
+	slot->start = ktime_get();
+
+	// render straight away, the timer keeps itself running while effects
+	// play. Armed under the lock so it can't be once stopped is set
+	if(!drvdata->stopped)
+		hrtimer_start(&drvdata->ff_timer, 0, HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+	return 0;
+}
+
+static void procon_ff_set_gain(struct input_dev *input, u16 gain)
+{
+	struct procon_data *drvdata = input_get_drvdata(input);
+	unsigned long flags;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->ff_gain = gain;
+	if(!drvdata->stopped)
+		hrtimer_start(&drvdata->ff_timer, 0, HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+}
+
+static int procon_input_register(struct procon_data *drvdata)
+{
+	struct hid_device *hdev = drvdata->hdev;
+	struct input_dev *input = input_allocate_device();
+	int retval;
+	int i;
+
+	//~ hid_info(hdev, "procon_input_register");
+
+	if(!input)
+		return -ENOMEM;
+	
+	input_set_drvdata(input, drvdata);
+	input->name = hdev->bus == BUS_USB? "Pro Controller (Wired)"  : "Pro Controller (Wireless)";
+	input->id.bustype = hdev->bus;
+	input->id.vendor = hdev->vendor;
+	input->id.product = hdev->product;
+	input->id.version = hdev->version;
+	input->dev.parent = &hdev->dev;
+
+	for(i = 0;i < PROCON_BTN_COUNT;i++)
+		input_set_capability(input, EV_KEY, keymap[i]);
+	input_set_capability(input, EV_MSC, MSC_TIMESTAMP);
+	input_set_capability(input, EV_FF, FF_RUMBLE);
+	input_set_capability(input, EV_FF, FF_CONSTANT);
+	input_set_capability(input, EV_FF, FF_PERIODIC);
+	input_set_capability(input, EV_FF, FF_SINE);
+	input_set_capability(input, EV_FF, FF_SQUARE);
+	input_set_capability(input, EV_FF, FF_TRIANGLE);
+	input_set_capability(input, EV_FF, FF_SAW_UP);
+	input_set_capability(input, EV_FF, FF_SAW_DOWN);
+	input_set_capability(input, EV_FF, FF_GAIN);
+	input_set_abs_params(input, ABS_X, -0x7FFF, 0x7FFF, 0, 0x7FF);
+	input_set_abs_params(input, ABS_Y, -0x7FFF, 0x7FFF, 0, 0x7FF);
+	input_set_abs_params(input, ABS_RX, -0x7FFF, 0x7FFF, 0, 0x7FF);
+	input_set_abs_params(input, ABS_RY, -0x7FFF, 0x7FFF, 0, 0x7FF);
+	input_set_abs_params(input, ABS_TILT_X, -0x7FFF, 0x7FFF, 0x0F, 0);
+	input_set_abs_params(input, ABS_TILT_Y, -0x7FFF, 0x7FFF, 0x0F, 0);
+
+	retval = input_ff_create(input, PROCON_FF_EFFECTS);
+	if(retval)
+	{
+		hid_err(hdev, "Could not enable force feedback (error %d)\n", retval);
+		goto error;
+	}
+	input->ff->upload = procon_ff_upload;
+	input->ff->erase = procon_ff_erase;
+	input->ff->playback = procon_ff_playback;
+	input->ff->set_gain = procon_ff_set_gain;
+
+	retval = input_register_device(input);
+	if(retval)
+		goto error;
+	else
 		drvdata->input = input;
 
-	retval = input_ff_create_memless(input, NULL, procon_play);
-	if(retval)
+	return 0;
+
+error:
+	input_free_device(input);
+	return retval;
+}
+
+// returns whether a subcommand sent through hidraw is still waiting for its
+// ack, forgetting it if the controller never answered. Called with
+// drvdata->lock held
+static bool procon_hidraw_pending(struct procon_data *drvdata)
+{
+	if(drvdata->hidraw_cmd && time_after(jiffies, drvdata->hidraw_time + msecs_to_jiffies(PROCON_ACK_TIMEOUT_MS)))
+		drvdata->hidraw_cmd = 0;
+	return drvdata->hidraw_cmd;
+}
+
+// look at output reports written through hidraw, keep the cached mode in step
+// with subcommands that change it and refuse them in exclusive mode
+static int procon_hidraw_filter(struct procon_data *drvdata, const u8 *buf, size_t len)
+{
+	const u8 *cmd = NULL;
+	unsigned long flags;
+	bool idle;
+
+	if(len > 11 && buf[0] == PROCON_CMD_AND_RUMBLE)
+		cmd = buf + 10;
+	else if(len > 19 && buf[0] == PROCON_REPORT_SEND_USB && buf[1] == PROCON_USB_DO_CMD && buf[8] == PROCON_CMD_AND_RUMBLE)
+		cmd = buf + 18;
+	else if(len > 1 && buf[0] == PROCON_REPORT_SEND_USB && buf[1] != PROCON_USB_DO_CMD)
+	{
+		// the driver owns the USB link
+		return drvdata->hidraw_exclusive? -EBUSY : 0;
+	}
+
+	if(!cmd)
+		return 0;
+
+	switch(cmd[0])
+	{
+	case PROCON_CMD_MODE:
+	case PROCON_CMD_GYRO:
+	case PROCON_CMD_LED:
+	case PROCON_CMD_LED_HOME:
+		if(drvdata->hidraw_exclusive)
+			return -EBUSY;
+		break;
+	default:
+		return 0;
+	}
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	// one at a time, a second one's ack couldn't be told apart
+	if(procon_hidraw_pending(drvdata))
+	{
+		spin_unlock_irqrestore(&drvdata->lock, flags);
+		return -EBUSY;
+	}
+	// its acknowledgement belongs to hidraw, not procon_work_event, and the
+	// mode changes once it arrives, see procon_hidraw_ack
+	drvdata->hidraw_cmd = cmd[0];
+	drvdata->hidraw_arg = cmd[1];
+	drvdata->hidraw_time = jiffies;
+	// whoever sent it is using the controller, there's nothing left to wake
+	idle = drvdata->idle;
+	drvdata->idle = false;
+	drvdata->idle_last = jiffies;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	if(idle)
+		procon_idle_schedule(drvdata, READ_ONCE(drvdata->idle_timeout) * HZ);
+
+	return 0;
+}
+
+// returns whether an acknowledged subcommand was sent through hidraw, and
+// applies its mode change now that the controller's reports follow it. A
+// slot the controller never acked expires, so it can't swallow the driver's
+// own acks. Called with drvdata->lock held
+static bool procon_hidraw_ack(struct procon_data *drvdata, u8 ack)
+{
+	u8 arg = drvdata->hidraw_arg;
+
+	if(!procon_hidraw_pending(drvdata) || ack != drvdata->hidraw_cmd)
+		return false;
+	drvdata->hidraw_cmd = 0;
+
+	if(ack == PROCON_CMD_MODE && arg == PROCON_ARG_INPUT_SIMPLE)
+		drvdata->mode = PROCON_MODE_SIMPLE;
+	else if(ack == PROCON_CMD_MODE && arg == PROCON_ARG_INPUT_FULL && drvdata->mode == PROCON_MODE_SIMPLE)
+		drvdata->mode = PROCON_MODE_FULL;
+	else if(ack == PROCON_CMD_GYRO && arg && drvdata->mode == PROCON_MODE_FULL)
+		drvdata->mode = PROCON_MODE_GYRO;
+	else if(ack == PROCON_CMD_GYRO && !arg && drvdata->mode == PROCON_MODE_GYRO)
+		drvdata->mode = PROCON_MODE_FULL;
+	drvdata->mode_new = drvdata->mode;
+	return true;
+}
+
+static int procon_ll_output_report(struct hid_device *hdev, __u8 *buf, size_t len)
+{
+	struct procon_data *drvdata = hid_get_drvdata(hdev);
+	int retval;
+
+	if(READ_ONCE(drvdata->send_task) == current)
+		return drvdata->ll_driver->output_report(hdev, buf, len);
+
+	mutex_lock(&drvdata->mutex);
+	retval = procon_hidraw_filter(drvdata, buf, len);
+	if(!retval)
+		retval = drvdata->ll_driver->output_report(hdev, buf, len);
+	mutex_unlock(&drvdata->mutex);
+
+	return retval;
+}
+
+static int procon_ll_raw_request(struct hid_device *hdev, unsigned char reportnum, __u8 *buf, size_t len, unsigned char rtype, int reqtype)
+{
+	struct procon_data *drvdata = hid_get_drvdata(hdev);
+	int retval = 0;
+
+	if(rtype != HID_OUTPUT_REPORT || reqtype != HID_REQ_SET_REPORT || READ_ONCE(drvdata->send_task) == current)
+		return drvdata->ll_driver->raw_request(hdev, reportnum, buf, len, rtype, reqtype);
+
+	mutex_lock(&drvdata->mutex);
+	retval = procon_hidraw_filter(drvdata, buf, len);
+	if(!retval)
+		retval = drvdata->ll_driver->raw_request(hdev, reportnum, buf, len, rtype, reqtype);
+	mutex_unlock(&drvdata->mutex);
+
+	return retval;
+}
+
+// Everything that sends output reports, hidraw included, ends up in the
+// transport's ll_driver, and HID has no driver callback for output. So the
+// device gets a copy of the transport's operations with the two senders
+// wrapped. The driver itself only looks at hdev->bus, not at ll_driver, so
+// hid_is_usb() and hid_is_using_ll_driver() no longer matching this device
+// doesn't matter here. The original is put back once the device is stopped.
+static void procon_ll_shim_install(struct procon_data *drvdata)
+{
+	struct hid_device *hdev = drvdata->hdev;
+
+	drvdata->ll_driver = hdev->ll_driver;
+	drvdata->ll_shim = *hdev->ll_driver;
+	drvdata->ll_shim.raw_request = procon_ll_raw_request;
+	if(drvdata->ll_driver->output_report)
+		drvdata->ll_shim.output_report = procon_ll_output_report;
+	hdev->ll_driver = &drvdata->ll_shim;
+}
+
+static void procon_ll_shim_remove(struct procon_data *drvdata)
+{
+	drvdata->hdev->ll_driver = drvdata->ll_driver;
+}
+
+static ssize_t hidraw_mode_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct procon_data *drvdata = hid_get_drvdata(to_hid_device(dev));
+
+	return sysfs_emit(buf, drvdata->hidraw_exclusive? "shared [exclusive]\n" : "[shared] exclusive\n");
+}
+
+// shared lets hidraw change the mode and tracks it, exclusive refuses
+// subcommands that fight the driver's own setup with -EBUSY
+static ssize_t hidraw_mode_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct procon_data *drvdata = hid_get_drvdata(to_hid_device(dev));
+	bool exclusive;
+
+	if(sysfs_streq(buf, "exclusive"))
+		exclusive = true;
+	else if(sysfs_streq(buf, "shared"))
+		exclusive = false;
+	else
+		return -EINVAL;
+
+	mutex_lock(&drvdata->mutex);
+	drvdata->hidraw_exclusive = exclusive;
+	mutex_unlock(&drvdata->mutex);
+
+	return count;
+}
+static DEVICE_ATTR_RW(hidraw_mode);
+
+static void procon_shm_free(struct kref *kref)
+{
+	struct procon_shmdev *shmdev = container_of(kref, struct procon_shmdev, kref);
+
+	__free_page(shmdev->page);
+	kfree(shmdev);
+}
+
+static int procon_shm_open(struct inode *inode, struct file *file)
+{
+	struct procon_shmdev *shmdev = container_of(file->private_data, struct procon_shmdev, misc);
+
+	kref_get(&shmdev->kref);
+	file->private_data = shmdev;
+	return 0;
+}
+
+static int procon_shm_release(struct inode *inode, struct file *file)
+{
+	struct procon_shmdev *shmdev = file->private_data;
+
+	kref_put(&shmdev->kref, procon_shm_free);
+	return 0;
+}
+
+static int procon_shm_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct procon_shmdev *shmdev = file->private_data;
+
+	if(vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	// the mapping holds its own reference to the page, so it outlives the device
+	return vm_insert_page(vma, vma->vm_start, shmdev->page);
+}
+
+static const struct file_operations procon_shm_fops =
+{
+	.owner =	THIS_MODULE,
+	.open =		procon_shm_open,
+	.release =	procon_shm_release,
+	.mmap =		procon_shm_mmap,
+};
+
+static int procon_shm_register(struct procon_data *drvdata)
+{
+	struct procon_shmdev *shmdev;
+	int retval;
+
+	shmdev = kzalloc(sizeof(*shmdev), GFP_KERNEL);
+	if(!shmdev)
+		return -ENOMEM;
+
+	shmdev->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if(!shmdev->page)
+	{
+		retval = -ENOMEM;
+		goto error_page;
+	}
+
+	shmdev->id = ida_alloc(&procon_ida, GFP_KERNEL);
+	if(shmdev->id < 0)
+	{
+		retval = shmdev->id;
+		goto error_ida;
+	}
+
+	kref_init(&shmdev->kref);
+	snprintf(shmdev->name, sizeof(shmdev->name), "procon%d", shmdev->id);
+	shmdev->misc.minor = MISC_DYNAMIC_MINOR;
+	shmdev->misc.name = shmdev->name;
+	shmdev->misc.fops = &procon_shm_fops;
+	shmdev->misc.parent = &drvdata->hdev->dev;
+
+	retval = misc_register(&shmdev->misc);
+	if(retval)
+		goto error_register;
+
+	drvdata->shmdev = shmdev;
+	drvdata->shm_page = page_address(shmdev->page);
+	return 0;
+
+error_register:
+	ida_free(&procon_ida, shmdev->id);
+error_ida:
+	__free_page(shmdev->page);
+error_page:
+	kfree(shmdev);
+	return retval;
+}
+
+static void procon_shm_unregister(struct procon_data *drvdata)
+{
+	struct procon_shmdev *shmdev = drvdata->shmdev;
+
+	if(!shmdev)
+		return;
+
+	misc_deregister(&shmdev->misc);
+	ida_free(&procon_ida, shmdev->id);
+	drvdata->shm_page = NULL;
+	kref_put(&shmdev->kref, procon_shm_free);
+}
+
+// publish the newest state, readers retry while seq is odd or has moved on
+static void procon_shm_update(struct procon_shm *state, ktime_t timestamp, u32 buttons, const s16 *axes, const u8 *imu, const s32 *gyro_bias)
+{
+	int i;
+
+	WRITE_ONCE(state->seq, state->seq + 1);
+	smp_wmb();
+
+	state->reports++;
+	state->timestamp = ktime_to_ns(timestamp);
+	state->buttons = buttons;
+	memcpy(state->axes, axes, sizeof(state->axes));
+	for(i = 0;i < 3;i++)
+	{
+		state->accel[i] = imu? *((s16 *) (imu + i * 2)) : 0;
+		state->gyro[i] = imu? *((s16 *) (imu + 6 + i * 2)) - (gyro_bias[i] >> 8) : 0;
+	}
+
+	smp_wmb();
+	WRITE_ONCE(state->seq, state->seq + 1);
+}
+
+// collect the spread of every IMU word and the sum of the gyroscope words
+// over a window, and pull the bias estimate towards the window's mean if the
+// controller didn't move. imu points at the three samples of a full report,
+// called with drvdata->lock held
+static void procon_gyro_update_bias(struct procon_data *drvdata, const u8 *imu)
+{
+	bool rest = true;
+	int n, i;
+
+	for(n = 0;n < 3;n++)
+	{
+		const s16 *sample = (const s16 *) (imu + n * 12);
+
+		if(!drvdata->gyro_rest)
+		{
+			memcpy(drvdata->imu_min, sample, sizeof(drvdata->imu_min));
+			memcpy(drvdata->imu_max, sample, sizeof(drvdata->imu_max));
+			memset(drvdata->gyro_sum, 0, sizeof(drvdata->gyro_sum));
+		}
+		for(i = 0;i < 6;i++)
+		{
+			drvdata->imu_min[i] = min(drvdata->imu_min[i], sample[i]);
+			drvdata->imu_max[i] = max(drvdata->imu_max[i], sample[i]);
+		}
+		for(i = 0;i < 3;i++)
+			drvdata->gyro_sum[i] += sample[3 + i];
+		drvdata->gyro_rest++;
+	}
+
+	if(drvdata->gyro_rest < PROCON_GYRO_REST_SAMPLES)
+		return;
+
+	for(i = 0;i < 3;i++)
 	{
-		hid_err(hdev, "Could not enable force feedback (error %d)\n", retval);
-		goto error;
+		rest &= drvdata->imu_max[i] - drvdata->imu_min[i] <= PROCON_GYRO_REST_ACCEL;
+		rest &= drvdata->imu_max[3 + i] - drvdata->imu_min[3 + i] <= PROCON_GYRO_REST_GYRO;
 	}
-	
-	return 0;
+	if(rest)
+		for(i = 0;i < 3;i++)
+			drvdata->gyro_bias[i] += (s32) (div_s64((s64) drvdata->gyro_sum[i] * 256, drvdata->gyro_rest) - drvdata->gyro_bias[i]) >> PROCON_GYRO_BIAS_SHIFT;
+	drvdata->gyro_rest = 0;
+}
 
-error:
-	input_free_device(input);
-	return retval;
+static ssize_t gyro_bias_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct procon_data *drvdata = hid_get_drvdata(to_hid_device(dev));
+	unsigned long flags;
+	s32 bias[3];
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	memcpy(bias, drvdata->gyro_bias, sizeof(bias));
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	return sysfs_emit(buf, "%d %d %d\n", bias[0] / 256, bias[1] / 256, bias[2] / 256);
+}
+
+static ssize_t gyro_bias_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct procon_data *drvdata = hid_get_drvdata(to_hid_device(dev));
+	unsigned long flags;
+	s16 bias[3];
+
+	if(sscanf(buf, "%hd %hd %hd", &bias[0], &bias[1], &bias[2]) != 3)
+		return -EINVAL;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->gyro_bias[0] = bias[0] * 256;
+	drvdata->gyro_bias[1] = bias[1] * 256;
+	drvdata->gyro_bias[2] = bias[2] * 256;
+	drvdata->gyro_rest = 0;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(gyro_bias);
+
+static ssize_t idle_timeout_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct procon_data *drvdata = hid_get_drvdata(to_hid_device(dev));
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(drvdata->idle_timeout));
+}
+
+static ssize_t idle_timeout_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct procon_data *drvdata = hid_get_drvdata(to_hid_device(dev));
+	unsigned int timeout;
+
+	if(kstrtouint(buf, 0, &timeout))
+		return -EINVAL;
+
+	WRITE_ONCE(drvdata->idle_timeout, timeout);
+	procon_idle_schedule(drvdata, timeout * HZ);
+
+	return count;
+}
+static DEVICE_ATTR_RW(idle_timeout);
+
+// whether the controller is idle, and how long the last wake took
+static ssize_t idle_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct procon_data *drvdata = hid_get_drvdata(to_hid_device(dev));
+	unsigned long flags;
+	s64 wake_us;
+	bool idle;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	idle = drvdata->idle;
+	wake_us = drvdata->idle_wake_us;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	return sysfs_emit(buf, "%d %lld\n", idle, wake_us);
+}
+static DEVICE_ATTR_RO(idle);
+
+// called with drvdata->lock held whenever the chord table changes
+static void procon_chord_reset(struct procon_data *drvdata)
+{
+	int i;
+
+	drvdata->chord_mask = 0;
+	for(i = 0;i < PROCON_CHORDS;i++)
+		drvdata->chord_mask |= drvdata->chords[i].buttons;
+	drvdata->chord_pending = -1;
+	drvdata->chord_fired = false;
+}
+
+// arm the hold timer when a chord is pressed and disarm it once let go, so a
+// held chord fires on time even when no further reports arrive
+static void procon_chord_update(struct procon_data *drvdata, u32 buttons)
+{
+	unsigned long flags;
+	unsigned hold_ms = 0;
+	int chord = -1;
+	int i;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->chord_buttons = buttons;
+	buttons &= drvdata->chord_mask;
+
+	if(drvdata->stopped)
+	{
+		spin_unlock_irqrestore(&drvdata->lock, flags);
+		return;
+	}
+
+	// a chord that fired stays latched until all chord buttons are released
+	if(drvdata->chord_fired && buttons)
+	{
+		spin_unlock_irqrestore(&drvdata->lock, flags);
+		return;
+	}
+
+	for(i = 0;i < PROCON_CHORDS;i++)
+		if(drvdata->chords[i].buttons && buttons == drvdata->chords[i].buttons)
+		{
+			chord = i;
+			hold_ms = drvdata->chords[i].hold_ms;
+			break;
+		}
+
+	if(chord == drvdata->chord_pending && !drvdata->chord_fired)
+	{
+		spin_unlock_irqrestore(&drvdata->lock, flags);
+		return;
+	}
+	drvdata->chord_pending = chord;
+	drvdata->chord_fired = false;
+
+	// under the lock, so it can't be armed again after stopped is set
+	if(chord < 0)
+		hrtimer_try_to_cancel(&drvdata->chord_timer);
+	else
+		hrtimer_start(&drvdata->chord_timer, ms_to_ktime(hold_ms), HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+}
+
+static enum hrtimer_restart procon_chord_timer(struct hrtimer *timer)
+{
+	struct procon_data *drvdata = container_of(timer, struct procon_data, chord_timer);
+	unsigned long flags;
+	u32 buttons;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	if(drvdata->chord_pending < 0 || drvdata->chord_fired || drvdata->stopped)
+	{
+		spin_unlock_irqrestore(&drvdata->lock, flags);
+		return HRTIMER_NORESTART;
+	}
+
+	drvdata->chord_fired = true;
+	buttons = drvdata->chord_buttons;
+	switch(drvdata->chord_pending)
+	{
+	case PROCON_CHORD_GYRO:
+		drvdata->event_cmd = PROCON_EVENT_TOGGLE_GYRO;
+		drvdata->gyro_trigger = buttons & BIT(PROCON_BTN_TL)? 1 : buttons & BIT(PROCON_BTN_TR)? 2 : 0;
+		break;
+	case PROCON_CHORD_DPAD_LEFT:
+		drvdata->event_cmd = PROCON_CMD_LED;
+		drvdata->analog_dpad = drvdata->analog_dpad == 1 ? 0 : 1;
+		break;
+	case PROCON_CHORD_DPAD_RIGHT:
+		drvdata->event_cmd = PROCON_CMD_LED;
+		drvdata->analog_dpad = drvdata->analog_dpad == 2 ? 0 : 2;
+		break;
+	}
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	schedule_work(&drvdata->worker_event);
+	return HRTIMER_NORESTART;
+}
+
+static ssize_t chords_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct procon_data *drvdata = hid_get_drvdata(to_hid_device(dev));
+	struct procon_chord chords[PROCON_CHORDS];
+	unsigned long flags;
+	int len = 0;
+	int i;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	memcpy(chords, drvdata->chords, sizeof(chords));
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	for(i = 0;i < PROCON_CHORDS;i++)
+		len += sysfs_emit_at(buf, len, "%s 0x%05x %u\n", chord_names[i], chords[i].buttons, chords[i].hold_ms);
+	return len;
+}
+
+// "<name> <buttons> <hold_ms>", buttons is a mask of PROCON_BTN_* bits and 0
+// disables the chord
+static ssize_t chords_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct procon_data *drvdata = hid_get_drvdata(to_hid_device(dev));
+	unsigned long flags;
+	char name[16];
+	u32 buttons;
+	unsigned hold_ms;
+	int i;
+
+	if(sscanf(buf, "%15s %x %u", name, &buttons, &hold_ms) != 3)
+		return -EINVAL;
+	if(buttons & ~(BIT(PROCON_BTN_COUNT) - 1))
+		return -EINVAL;
+
+	for(i = 0;i < PROCON_CHORDS;i++)
+		if(!strcmp(name, chord_names[i]))
+			break;
+	if(i == PROCON_CHORDS)
+		return -EINVAL;
+
+	hrtimer_cancel(&drvdata->chord_timer);
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->chords[i].buttons = buttons;
+	drvdata->chords[i].hold_ms = hold_ms;
+	procon_chord_reset(drvdata);
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(chords);
+
+// permute the decoded buttons, bit n moves to bit map[n] or is dropped if negative
+static inline u32 procon_remap_buttons(const struct procon_remap *remap, u32 buttons)
+{
+	return remap->lut[0][buttons & 0xFF] |
+		   remap->lut[1][(buttons >> 8) & 0xFF] |
+		   remap->lut[2][(buttons >> 16) & 0xFF];
+}
+
+static ssize_t remap_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct procon_data *drvdata = hid_get_drvdata(to_hid_device(dev));
+	struct procon_remap *remap;
+	int len = 0;
+	int i;
+
+	rcu_read_lock();
+	remap = rcu_dereference(drvdata->remap);
+	for(i = 0;i < PROCON_BTN_COUNT;i++)
+		len += sysfs_emit_at(buf, len, "%d%c", remap? remap->map[i] : i, i + 1 < PROCON_BTN_COUNT? ' ' : '\n');
+	rcu_read_unlock();
+
+	return len;
+}
+
+// a target PROCON_BTN_* for each button in order, -1 drops a button and
+// buttons left out keep their place
+static ssize_t remap_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct procon_data *drvdata = hid_get_drvdata(to_hid_device(dev));
+	struct procon_remap *remap;
+	struct procon_remap *old;
+	unsigned long flags;
+	bool identity = true;
+	char *copy, *cursor, *token;
+	int byte, value, bit;
+	int retval = 0;
+	int i;
+
+	remap = kzalloc(sizeof(*remap), GFP_KERNEL);
+	copy = kstrndup(buf, count, GFP_KERNEL);
+	if(!remap || !copy)
+	{
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	for(i = 0;i < PROCON_BTN_COUNT;i++)
+		remap->map[i] = i;
+
+	cursor = strim(copy);
+	for(i = 0;i < PROCON_BTN_COUNT && (token = strsep(&cursor, " \t\n"));)
+	{
+		if(!*token)
+			continue;
+		if(kstrtoint(token, 0, &value) || value < -1 || value >= PROCON_BTN_COUNT)
+		{
+			retval = -EINVAL;
+			goto out;
+		}
+		remap->map[i++] = value;
+	}
+	if(cursor && *skip_spaces(cursor))
+	{
+		retval = -EINVAL;
+		goto out;
+	}
+
+	for(byte = 0;byte < 3;byte++)
+		for(value = 0;value < 256;value++)
+			for(bit = 0;bit < 8;bit++)
+			{
+				i = byte * 8 + bit;
+				if(i < PROCON_BTN_COUNT && (value & BIT(bit)) && remap->map[i] >= 0)
+					remap->lut[byte][value] |= BIT(remap->map[i]);
+			}
+
+	for(i = 0;i < PROCON_BTN_COUNT;i++)
+		identity &= remap->map[i] == i;
+
+	// the identity permutation skips the lookup altogether
+	if(identity)
+	{
+		kfree(remap);
+		remap = NULL;
+	}
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	old = rcu_dereference_protected(drvdata->remap, true);
+	rcu_assign_pointer(drvdata->remap, remap);
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	if(old)
+		kfree_rcu(old, rcu);
+	remap = NULL;
+
+out:
+	kfree(remap);
+	kfree(copy);
+	return retval? retval : count;
+}
+static DEVICE_ATTR_RW(remap);
+
+static struct attribute *procon_attrs[] =
+{
+	&dev_attr_gyro_bias.attr,
+	&dev_attr_idle_timeout.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_chords.attr,
+	&dev_attr_remap.attr,
+	&dev_attr_hidraw_mode.attr,
+	NULL,
+};
+
+static const struct attribute_group procon_attr_group =
+{
+	.attrs = procon_attrs,
+};
+
+static struct procon_state *procon_find_state(struct hid_device *hdev)
+{
+	int i;
+
+	for(i = 0;i < 8;i++)
+		if(!strncmp(states[i].uniq, hdev->uniq, sizeof(states[i].uniq)))
+			return &states[i];
+	return NULL;
+}
+
+static void procon_load_state(struct procon_data *drvdata)
+{
+	struct procon_state *state;
+
+	if(!drvdata->hdev->uniq[0] || drvdata->hdev->bus == BUS_USB)
+		return;
+
+	mutex_lock(&connections_lock);
+	state = procon_find_state(drvdata->hdev);
+	if(state)
+	{
+		drvdata->analog_dpad = state->analog_dpad;
+		drvdata->gyro_trigger = state->gyro_trigger;
+		memcpy(drvdata->gyro_bias, state->gyro_bias, sizeof(drvdata->gyro_bias));
+		drvdata->mode_new = state->gyro? PROCON_MODE_GYRO : drvdata->hdev->bus == BUS_USB? PROCON_MODE_FULL : PROCON_MODE_SIMPLE;
+		drvdata->restore = true;
+	}
+	mutex_unlock(&connections_lock);
+}
+
+static void procon_save_state(struct procon_data *drvdata)
+{
+	struct procon_state *state;
+	unsigned long flags;
+
+	if(!drvdata->hdev->uniq[0] || drvdata->hdev->bus == BUS_USB || !drvdata->connected)
+		return;
+
+	mutex_lock(&connections_lock);
+	state = procon_find_state(drvdata->hdev);
+	if(!state)
+	{
+		state = &states[states_next];
+		states_next = (states_next + 1) % 8;
+		strscpy(state->uniq, drvdata->hdev->uniq, sizeof(state->uniq));
+	}
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	state->gyro = (drvdata->idle? drvdata->idle_mode : drvdata->mode) == PROCON_MODE_GYRO;
+	state->analog_dpad = drvdata->analog_dpad;
+	state->gyro_trigger = drvdata->gyro_trigger;
+	memcpy(state->gyro_bias, drvdata->gyro_bias, sizeof(state->gyro_bias));
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+	mutex_unlock(&connections_lock);
 }
 
 static int procon_probe(struct hid_device *hdev, const struct hid_device_id *id)
@@ -484,9 +2091,24 @@ static int procon_probe(struct hid_device *hdev, const struct hid_device_id *id)
 	hid_set_drvdata(hdev, drvdata);
 	spin_lock_init(&drvdata->lock);
 	mutex_init(&drvdata->mutex);
+	mutex_init(&drvdata->send_mutex);
 	INIT_WORK(&drvdata->worker_connect, procon_work_connect);
 	INIT_WORK(&drvdata->worker_event, procon_work_event);
 	INIT_WORK(&drvdata->worker_rumble, procon_work_rumble);
+	INIT_WORK(&drvdata->worker_resume, procon_work_resume);
+	INIT_DELAYED_WORK(&drvdata->worker_idle, procon_work_idle);
+	INIT_WORK(&drvdata->worker_wake, procon_work_wake);
+	drvdata->idle_timeout = idle_timeout;
+	drvdata->idle_last = jiffies;
+	init_completion(&drvdata->ack);
+	hrtimer_init(&drvdata->ff_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	drvdata->ff_timer.function = procon_ff_timer;
+	drvdata->ff_gain = 0xFFFF;
+	hrtimer_init(&drvdata->chord_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	drvdata->chord_timer.function = procon_chord_timer;
+	memcpy(drvdata->chords, chords_default, sizeof(drvdata->chords));
+	procon_chord_reset(drvdata);
+	procon_ll_shim_install(drvdata);
 	retval = hid_hw_start(hdev, HID_CONNECT_HIDRAW | HID_CONNECT_HIDDEV_FORCE);
 	if(retval)
 	{
@@ -508,7 +2130,20 @@ static int procon_probe(struct hid_device *hdev, const struct hid_device_id *id)
 		goto error_input;
 	}
 
+	retval = sysfs_create_group(&hdev->dev.kobj, &procon_attr_group);
+	if(retval)
+		hid_warn(hdev, "Could not create sysfs attributes (error %d)\n", retval);
+
+	if(shm)
+	{
+		retval = procon_shm_register(drvdata);
+		if(retval)
+			hid_warn(hdev, "Could not create state device (error %d)\n", retval);
+	}
+
+	procon_load_state(drvdata);
 	schedule_work(&drvdata->worker_connect);
+	procon_idle_schedule(drvdata, drvdata->idle_timeout * HZ);
 
 	return 0;
 
@@ -517,58 +2152,83 @@ error_input:
 error_open:
 	hid_hw_stop(hdev);
 error_start:
+	procon_ll_shim_remove(drvdata);
 	return retval;
 }
 
 static void procon_remove(struct hid_device *hdev)
 {
 	struct procon_data *drvdata = hid_get_drvdata(hdev);
+	unsigned long flags;
 	u8 order;
 	
 	//~ hid_info(hdev, "procon_remove\n");
 	
+	// once stopped is set neither reports, hidraw writes nor effects can
+	// re-arm the timers and works, so they are cancelled while the device
+	// can still be talked to
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->stopped = true;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	sysfs_remove_group(&hdev->dev.kobj, &procon_attr_group);
+
+	hrtimer_cancel(&drvdata->ff_timer);
+	hrtimer_cancel(&drvdata->chord_timer);
 	cancel_work_sync(&drvdata->worker_connect);
 	cancel_work_sync(&drvdata->worker_event);
 	cancel_work_sync(&drvdata->worker_rumble);
-	
+	cancel_work_sync(&drvdata->worker_resume);
+	cancel_delayed_work_sync(&drvdata->worker_idle);
+	cancel_work_sync(&drvdata->worker_wake);
+
+	procon_save_state(drvdata);
+
 	mutex_lock(&connections_lock);
 	order = drvdata->order;
-	connections[order] = NULL;
+	if(connections[order] == drvdata)
+		connections[order] = NULL;
 	mutex_unlock(&connections_lock);	
 	
 	hid_info(hdev, hdev->bus == BUS_USB? "Pro Controller (Wired) #%d disconnected\n"  : "Pro Controller (Wireless) #%d disconnected\n", order + 1);
-	input_unregister_device(drvdata->input);
+
+	// raw_event reports into the input device, so it goes after the hardware
 	hid_hw_close(hdev);
 	hid_hw_stop(hdev);
+	procon_ll_shim_remove(drvdata);
+	input_unregister_device(drvdata->input);
+
+	procon_shm_unregister(drvdata);
+	kfree(rcu_dereference_protected(drvdata->remap, true));
 }
 
 static int procon_raw_event(struct hid_device *hdev, struct hid_report *report, u8 *data, int size)
 {
+	// stamp events with their arrival time rather than whenever the input
+	// core gets around to them
+	ktime_t timestamp = ktime_get();
 	struct procon_data *drvdata = hid_get_drvdata(hdev);
 	struct input_dev *input = drvdata->input;
-	u64 drvtime;
-	u64 time;
 	unsigned long flags;
+	u8 ack_cmd;
+	bool hidraw_ack;
 	
-	bool home_button,
-		 left_button,
-		 right_button,
-		 triggerl_button,
-		 triggerr_button;
+	struct procon_remap *remap;
 	int	analog_dpad,
 		gyro_trigger;
 	enum modes mode;
+	bool idle;
 
 	spin_lock_irqsave(&drvdata->lock, flags);
 	mode = drvdata->mode;
 	analog_dpad = drvdata->analog_dpad;
 	gyro_trigger = drvdata->gyro_trigger;
-	drvtime = drvdata->time;
+	idle = drvdata->idle;
 	spin_unlock_irqrestore(&drvdata->lock, flags);
 
 	// if bluetooth was enabled then the controller was plugged in,
-	// gyroscope might still be on
-	if(unlikely(data[PROCON_REPORT_TYPE] == PROCON_REPORT_INPUT_FULL && data[13] != 0x00 && mode == PROCON_MODE_FULL))
+	// gyroscope might still be on, unless it was just turned off for idling
+	if(unlikely(data[PROCON_REPORT_TYPE] == PROCON_REPORT_INPUT_FULL && data[13] != 0x00 && mode == PROCON_MODE_FULL && !idle))
 	{
 		spin_lock_irqsave(&drvdata->lock, flags);
 		drvdata->mode = PROCON_MODE_GYRO;
@@ -591,31 +2251,63 @@ static int procon_raw_event(struct hid_device *hdev, struct hid_report *report,
 		
 		// after sending commands, the controller will return an acknowledgement
 		// respond to each ack with the next command to set up the controller 
-		if(data[PROCON_REPORT_CMD_ACK] == PROCON_CMD_MODE || 
+		spin_lock_irqsave(&drvdata->lock, flags);
+		ack_cmd = drvdata->ack_cmd;
+		hidraw_ack = !(ack_cmd && data[PROCON_REPORT_CMD_ACK] == ack_cmd) &&
+					 procon_hidraw_ack(drvdata, data[PROCON_REPORT_CMD_ACK]);
+		spin_unlock_irqrestore(&drvdata->lock, flags);
+
+		// replayed commands are waited on directly, and commands sent through
+		// hidraw are left to whoever sent them
+		if(ack_cmd && data[PROCON_REPORT_CMD_ACK] == ack_cmd)
+			complete(&drvdata->ack);
+		else if(hidraw_ack)
+			;
+		else if(data[PROCON_REPORT_CMD_ACK] == PROCON_CMD_MODE || 
 		   data[PROCON_REPORT_CMD_ACK] == PROCON_CMD_GYRO ||
 		   data[PROCON_REPORT_CMD_ACK] == PROCON_CMD_LED ||
 		   data[PROCON_REPORT_CMD_ACK] == PROCON_CMD_LED_HOME)
 		{
 			spin_lock_irqsave(&drvdata->lock, flags);
 			drvdata->event_cmd = data[PROCON_REPORT_CMD_ACK];
+			if(!drvdata->stopped)
+				schedule_work(&drvdata->worker_event);
 			spin_unlock_irqrestore(&drvdata->lock, flags);
-			
-			schedule_work(&drvdata->worker_event);
 		}
 	}
 
 	if(data[PROCON_REPORT_TYPE] == PROCON_REPORT_INPUT_FULL || 
 	   data[PROCON_REPORT_TYPE] == PROCON_REPORT_INPUT_SIMPLE)
 	{
+		s16 x, y, rx, ry,
+			gx = 0,
+			gy = 0;
+		s32 gyro_bias[3] = {0, 0, 0};
+		u32 buttons = 0;
+		int i;
+
 		if(mode != PROCON_MODE_SIMPLE)
 		{
+			// the tilt axes follow the accelerometer, so they have no drift
+			// of their own, the bias estimate only corrects the gyroscope rates
+			gx = *((s16 *) (data + 15)) * 7;
+			gy = *((s16 *) (data + 13)) * 7;
+
 			// each axis is 12 bits in a 6 byte data chunk
-			s16 x  = (*((u16 *) (data + 6)) << 4) & 0xFFF0;
-			s16 y  =  *((u16 *) (data + 7))       & 0xFFF0;
-			s16 rx = (*((u16 *) (data + 9)) << 4) & 0xFFF0;
-			s16 ry =  *((u16 *) (data + 10))      & 0xFFF0;
-			s16 gy  = (*((u16 *) (data + 13)) * 7);
-			s16 gx  =   *((u16 *) (data + 15)) * 7;
+			x  = (*((u16 *) (data + 6)) << 4) & 0xFFF0;
+			y  =  *((u16 *) (data + 7))       & 0xFFF0;
+			rx = (*((u16 *) (data + 9)) << 4) & 0xFFF0;
+			ry =  *((u16 *) (data + 10))      & 0xFFF0;
+
+			// learn the gyroscope's drift whenever the controller lies still,
+			// only the state page carries the rates it corrects
+			if(drvdata->shm_page && mode == PROCON_MODE_GYRO && data[PROCON_REPORT_TYPE] == PROCON_REPORT_INPUT_FULL)
+			{
+				spin_lock_irqsave(&drvdata->lock, flags);
+				procon_gyro_update_bias(drvdata, data + 13);
+				memcpy(gyro_bias, drvdata->gyro_bias, sizeof(gyro_bias));
+				spin_unlock_irqrestore(&drvdata->lock, flags);
+			}
 
 			if(!analog_dpad)
 			{
@@ -674,54 +2366,16 @@ static int procon_raw_event(struct hid_device *hdev, struct hid_report *report,
 				ry = (!!(data[5] & 0x01)*0x7FFF) - (!!(data[5] & 0x02))*0x7FFF;
 			}
 			
-			input_report_abs(input, ABS_X, x);
-			input_report_abs(input, ABS_Y, y);
-			input_report_abs(input, ABS_RX, rx);
-			input_report_abs(input, ABS_RY, ry);
-			input_report_abs(input, ABS_TILT_X, gx);
-			input_report_abs(input, ABS_TILT_Y, gy);
-
-			input_report_key(input, BTN_A,			(data[3] & 0x08));
-			input_report_key(input, BTN_B,			(data[3] & 0x04));
-			input_report_key(input, BTN_X,			(data[3] & 0x02));
-			input_report_key(input, BTN_Y,			(data[3] & 0x01));
-			input_report_key(input, BTN_TL,			(data[5] & 0x40));
-			input_report_key(input, BTN_TR,			(data[3] & 0x40));
-			input_report_key(input, BTN_TL2,		(data[5] & 0x80));
-			input_report_key(input, BTN_TR2,		(data[3] & 0x80));
-			input_report_key(input, BTN_SELECT,		(data[4] & 0x01));
-			input_report_key(input, BTN_START,		(data[4] & 0x02));
-			input_report_key(input, BTN_MODE,		(data[4] & 0x10));
-			input_report_key(input, BTN_EXTRA,		(data[4] & 0x20));
-			input_report_key(input, BTN_THUMBL,		(data[4] & 0x08));
-			input_report_key(input, BTN_THUMBR,		(data[4] & 0x04));
-			if(!analog_dpad)
-			{
-				input_report_key(input, BTN_DPAD_UP,	(data[5] & 0x02));
-				input_report_key(input, BTN_DPAD_DOWN,	(data[5] & 0x01));
-				input_report_key(input, BTN_DPAD_LEFT,	(data[5] & 0x08));
-				input_report_key(input, BTN_DPAD_RIGHT,	(data[5] & 0x04));
-			}
-			else
-			{
-				input_report_key(input, BTN_DPAD_UP,	false);
-				input_report_key(input, BTN_DPAD_DOWN,	false);
-				input_report_key(input, BTN_DPAD_LEFT,	false);
-				input_report_key(input, BTN_DPAD_RIGHT,	false);
-			}
-
-			home_button = !!(data[4] & 0x10);
-			left_button = !!(data[4] & 0x08);
-			right_button = !!(data[4] & 0x04);
-			triggerl_button = !!(data[5] & 0x40);
-			triggerr_button = !!(data[3] & 0x40);
+			for(i = 0;i < PROCON_BTN_COUNT;i++)
+				if(data[buttonmap_full[i].byte] & buttonmap_full[i].mask)
+					buttons |= BIT(i);
 		}
 		else
 		{
-			s16 x  = *((s16 *) (data + 4));
-			s16 y  = *((s16 *) (data + 6));
-			s16 rx = *((s16 *) (data + 8));
-			s16 ry = *((s16 *) (data + 10));
+			x  = *((s16 *) (data + 4));
+			y  = *((s16 *) (data + 6));
+			rx = *((s16 *) (data + 8));
+			ry = *((s16 *) (data + 10));
 			if(!analog_dpad)
 			{
 				x  -= 0x7FFF;
@@ -744,106 +2398,140 @@ static int procon_raw_event(struct hid_device *hdev, struct hid_report *report,
 				ry = hatmap[data[3]].down*0x7FFF - hatmap[data[3]].up*0x7FFF;
 			}
 			
-			input_report_abs(input, ABS_X, x);
-			input_report_abs(input, ABS_Y, y);
-			input_report_abs(input, ABS_RX, rx);
-			input_report_abs(input, ABS_RY, ry);
-			input_report_abs(input, ABS_TILT_X, 0x00);
-			input_report_abs(input, ABS_TILT_Y, 0x00);
-
-			input_report_key(input, BTN_A,			(data[1] & 0x02));
-			input_report_key(input, BTN_B,			(data[1] & 0x01));
-			input_report_key(input, BTN_X,			(data[1] & 0x08));
-			input_report_key(input, BTN_Y,			(data[1] & 0x04));
-			input_report_key(input, BTN_TL,			(data[1] & 0x10));
-			input_report_key(input, BTN_TR,			(data[1] & 0x20));
-			input_report_key(input, BTN_TL2,		(data[1] & 0x40));
-			input_report_key(input, BTN_TR2,		(data[1] & 0x80));
-			input_report_key(input, BTN_SELECT,		(data[2] & 0x01));
-			input_report_key(input, BTN_START,		(data[2] & 0x02));
-			input_report_key(input, BTN_MODE,		(data[2] & 0x10));
-			input_report_key(input, BTN_EXTRA,		(data[2] & 0x20));
-			input_report_key(input, BTN_THUMBL,		(data[2] & 0x04));
-			input_report_key(input, BTN_THUMBR,		(data[2] & 0x08));
-			if(!analog_dpad)
-			{
-				input_report_key(input, BTN_DPAD_UP,	hatmap[data[3]].up);
-				input_report_key(input, BTN_DPAD_DOWN,	hatmap[data[3]].down);
-				input_report_key(input, BTN_DPAD_LEFT,	hatmap[data[3]].left);
-				input_report_key(input, BTN_DPAD_RIGHT,	hatmap[data[3]].right);
-			}
-			else
-			{
-				input_report_key(input, BTN_DPAD_UP,	false);
-				input_report_key(input, BTN_DPAD_DOWN,	false);
-				input_report_key(input, BTN_DPAD_LEFT,	false);
-				input_report_key(input, BTN_DPAD_RIGHT,	false);
-			}
-
-			home_button = !!(data[2] & 0x10);
-			left_button = !!(data[2] & 0x04);
-			right_button = !!(data[2] & 0x08);
-			triggerl_button = !!(data[1] & 0x10);
-			triggerr_button = !!(data[1] & 0x20);
+			for(i = 0;i < PROCON_BTN_DPAD_UP;i++)
+				if(data[buttonmap_simple[i].byte] & buttonmap_simple[i].mask)
+					buttons |= BIT(i);
+			buttons |= hatmap[data[3]].up << PROCON_BTN_DPAD_UP |
+					   hatmap[data[3]].down << PROCON_BTN_DPAD_DOWN |
+					   hatmap[data[3]].left << PROCON_BTN_DPAD_LEFT |
+					   hatmap[data[3]].right << PROCON_BTN_DPAD_RIGHT;
 		}
-		input_sync(input);
 
-		if(home_button)
+		// chords act on the physical buttons
+		procon_chord_update(drvdata, buttons);
+		procon_idle_update(drvdata, data[PROCON_REPORT_TYPE], buttons, x, y, rx, ry);
+
+		// the d-pad is driving a joystick instead
+		if(analog_dpad)
+			buttons &= ~PROCON_DPAD_BUTTONS;
+
+		rcu_read_lock();
+		remap = rcu_dereference(drvdata->remap);
+		if(remap)
+			buttons = procon_remap_buttons(remap, buttons);
+		rcu_read_unlock();
+
+		input_report_abs(input, ABS_X, x);
+		input_report_abs(input, ABS_Y, y);
+		input_report_abs(input, ABS_RX, rx);
+		input_report_abs(input, ABS_RY, ry);
+		input_report_abs(input, ABS_TILT_X, gx);
+		input_report_abs(input, ABS_TILT_Y, gy);
+		for(i = 0;i < PROCON_BTN_COUNT;i++)
+			input_report_key(input, keymap[i], buttons & BIT(i));
+
+		// extend the controller's 8 bit timer into a free running microsecond
+		// counter so userspace can see the jitter added by the transport
+		if(data[PROCON_REPORT_TYPE] == PROCON_REPORT_INPUT_FULL)
 		{
-			time = ktime_get_ns();
-			if(drvtime > 1 && (time - drvtime > 2000000000))
-			{
-				if(!(left_button || right_button))
-				{
-					spin_lock_irqsave(&drvdata->lock, flags);
-					drvdata->event_cmd = PROCON_EVENT_TOGGLE_GYRO;
-					drvdata->gyro_trigger = triggerl_button ? 1 : triggerr_button ? 2 : 0;
-					drvdata->time = 1; // lock timer until key released
-					spin_unlock_irqrestore(&drvdata->lock, flags);
-
-					schedule_work(&drvdata->worker_event);
-				}
-				else if(left_button && !right_button)
-				{
-					spin_lock_irqsave(&drvdata->lock, flags);
-					drvdata->event_cmd = PROCON_CMD_LED;
-					drvdata->analog_dpad = analog_dpad == 1 ? 0 : 1;
-					drvdata->time = 1;
-					spin_unlock_irqrestore(&drvdata->lock, flags);
-					
-					schedule_work(&drvdata->worker_event);
-				}
-				else if(!left_button && right_button)
-				{
-					spin_lock_irqsave(&drvdata->lock, flags);
-					drvdata->event_cmd = PROCON_CMD_LED;
-					drvdata->analog_dpad = analog_dpad == 2 ? 0 : 2;
-					drvdata->time = 1;
-					spin_unlock_irqrestore(&drvdata->lock, flags);
-					
-					schedule_work(&drvdata->worker_event);
-				}
-			}
+			if(drvdata->timer_valid)
+				drvdata->timer_us += (u8) (data[1] - drvdata->timer) * PROCON_TIMER_TICK_US;
+			drvdata->timer = data[1];
+			drvdata->timer_valid = true;
+			input_event(input, EV_MSC, MSC_TIMESTAMP, drvdata->timer_us);
 		}
 		else
-			time = 0;
+			drvdata->timer_valid = false;
+
+		input_set_timestamp(input, timestamp);
+		input_sync(input);
 
-		if((!home_button && drvtime) || (home_button && !drvtime))
+		if(drvdata->shm_page)
 		{
-			spin_lock_irqsave(&drvdata->lock, flags);
-			drvdata->time = time;
-			spin_unlock_irqrestore(&drvdata->lock, flags);
+			s16 axes[PROCON_AXIS_COUNT] = {x, y, rx, ry, gx, gy};
+			bool imu = mode != PROCON_MODE_SIMPLE && data[PROCON_REPORT_TYPE] == PROCON_REPORT_INPUT_FULL;
+
+			procon_shm_update(drvdata->shm_page, timestamp, buttons, axes, imu? data + 13 : NULL, gyro_bias);
 		}
 	}
 	return 0;
 }
 
+#ifdef CONFIG_PM
+static int procon_suspend(struct hid_device *hdev, pm_message_t message)
+{
+	struct procon_data *drvdata = hid_get_drvdata(hdev);
+	unsigned long flags;
+
+	// reports keep arriving until the transport suspends
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->stopped = true;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	hrtimer_cancel(&drvdata->ff_timer);
+	hrtimer_cancel(&drvdata->chord_timer);
+	cancel_work_sync(&drvdata->worker_connect);
+	cancel_work_sync(&drvdata->worker_event);
+	cancel_work_sync(&drvdata->worker_rumble);
+	cancel_work_sync(&drvdata->worker_resume);
+	cancel_delayed_work_sync(&drvdata->worker_idle);
+	cancel_work_sync(&drvdata->worker_wake);
+
+	// the motors keep playing the last packet, silence them on the way down
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->rumble.h_freq = PROCON_RUMBLE_FREQ_HIGH;
+	drvdata->rumble.h_amp = 0;
+	drvdata->rumble.l_freq = PROCON_RUMBLE_FREQ_LOW;
+	drvdata->rumble.l_amp = 0;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+	procon_work_rumble(&drvdata->worker_rumble);
+	return 0;
+}
+
+static int procon_resume(struct hid_device *hdev)
+{
+	struct procon_data *drvdata = hid_get_drvdata(hdev);
+	unsigned long flags;
+	bool playing = false;
+	int i;
+
+	spin_lock_irqsave(&drvdata->lock, flags);
+	drvdata->stopped = false;
+	procon_chord_reset(drvdata);
+	// a wake cancelled on suspend is retried on the next change
+	drvdata->idle_waking = false;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+
+	// controllers that hadn't finished connecting start over
+	if(drvdata->connected)
+		schedule_work(&drvdata->worker_resume);
+	else
+		schedule_work(&drvdata->worker_connect);
+	drvdata->idle_last = jiffies;
+	procon_idle_schedule(drvdata, READ_ONCE(drvdata->idle_timeout) * HZ);
+
+	// pick up effects that were still playing when the timer was cancelled
+	spin_lock_irqsave(&drvdata->lock, flags);
+	for(i = 0;i < PROCON_FF_EFFECTS;i++)
+		playing |= drvdata->effects[i].playing;
+	spin_unlock_irqrestore(&drvdata->lock, flags);
+	if(playing)
+		hrtimer_start(&drvdata->ff_timer, 0, HRTIMER_MODE_REL);
+	return 0;
+}
+#endif
+
 static struct hid_driver procon_driver =
 {
 	.name =			"hid-procon",
 	.probe =		procon_probe,
 	.remove =		procon_remove,
 	.raw_event =	procon_raw_event,
+#ifdef CONFIG_PM
+	.suspend =		procon_suspend,
+	.resume =		procon_resume,
+	.reset_resume =	procon_resume,
+#endif
 	.id_table = 	procon_table,
 };
 module_hid_driver(procon_driver);
@@ -0,0 +1,74 @@
+#ifndef HID_PROCON_H
+#define HID_PROCON_H
+
+#include <linux/types.h>
+
+// bits of procon_shm.buttons, in the order the driver reports them
+enum procon_buttons
+{
+	PROCON_BTN_A,
+	PROCON_BTN_B,
+	PROCON_BTN_X,
+	PROCON_BTN_Y,
+	PROCON_BTN_TL,
+	PROCON_BTN_TR,
+	PROCON_BTN_TL2,
+	PROCON_BTN_TR2,
+	PROCON_BTN_SELECT,
+	PROCON_BTN_START,
+	PROCON_BTN_MODE,
+	PROCON_BTN_EXTRA,
+	PROCON_BTN_THUMBL,
+	PROCON_BTN_THUMBR,
+	PROCON_BTN_DPAD_UP,
+	PROCON_BTN_DPAD_DOWN,
+	PROCON_BTN_DPAD_LEFT,
+	PROCON_BTN_DPAD_RIGHT,
+	PROCON_BTN_COUNT
+};
+
+enum procon_axes
+{
+	PROCON_AXIS_X,
+	PROCON_AXIS_Y,
+	PROCON_AXIS_RX,
+	PROCON_AXIS_RY,
+	PROCON_AXIS_TILT_X,
+	PROCON_AXIS_TILT_Y,
+	PROCON_AXIS_COUNT
+};
+
+// Latest decoded controller state, mapped read only from /dev/proconN when the
+// module is loaded with shm=1. It is rewritten once per input report.
+//
+// seq is odd while the driver is writing. A consistent snapshot is one where
+// seq was even and unchanged before and after copying the rest of the page.
+struct procon_shm
+{
+	__u32 seq;
+	__u32 reports;			// input reports decoded so far
+	__u64 timestamp;		// CLOCK_MONOTONIC arrival time of the report in ns
+	__u32 buttons;			// BIT(PROCON_BTN_*), as reported to evdev
+	__s16 axes[PROCON_AXIS_COUNT];	// as reported to evdev
+	__s16 accel[3];			// IMU words of the newest sample, zero unless
+	__s16 gyro[3];			// the gyroscope is enabled. gyro has the
+					// driver's drift estimate removed
+};
+
+#ifndef __KERNEL__
+#include <string.h>
+
+static inline void procon_shm_read(const volatile struct procon_shm *shm, struct procon_shm *state)
+{
+	__u32 seq;
+
+	do
+	{
+		while((seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE)) & 1);
+		memcpy(state, (const struct procon_shm *) shm, sizeof(*state));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while(__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq);
+}
+#endif
+
+#endif